@@ -4,8 +4,8 @@
  * implements operator protocol for making af_unix connections
  * with callers from other mount/network namespaces.
  *
- * data sent from operator to host is 1 byte at a time,
- * currently only 'R' -- connection request.
+ * operator sends connection requests on the relay, see opproto.h.
+ * registration socket is only used to get the relay.
  *
  */
 
@@ -15,191 +15,1019 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <malloc.h>
 
 #include "ophost.h"
+#include "opproto.h"
 #include "../eslib/eslib.h"
 
+#define OPHOST_MAXEVENTS 64 /* epoll events handled per ophost_run wakeup */
+
+#define ophost_load(p_)	    __atomic_load_n((p_), __ATOMIC_ACQUIRE)
+#define ophost_store(p_, v_) __atomic_store_n((p_), (v_), __ATOMIC_RELEASE)
+
+/* application fd watched by ophost_run */
+struct ophost_watch
+{
+	int fd;
+	int (*cb)(struct ophost *self, int fd, unsigned int events, void *arg);
+	void *arg;
+	struct ophost_watch *next;
+};
+
+
+/* ptr is handed back by epoll, NULL for hosts own fds */
+static int ophost_poll_add(struct ophost *self, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = ptr;
+	return epoll_ctl(self->pollfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+/* milliseconds on the monotonic clock, for deadlines */
+static unsigned long ophost_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
 
 /*
- *  create the new af_unix connection and
- *  send that fd back to caller through operator.
- *
- *  note: this is a socketpair, so checking credentials at time
- *  of connection through SO_PEERCRED will not be very useful
- *  for host trying to authenticate a caller.
+ * sleep until sock is readable (or hung up), or deadline passes.
+ * returns
+ *  0 if readable
+ * -1 on error, ETIMEDOUT if deadline passed
  */
-static int ophost_create_callerhandshake(struct ophost *self)
+static int ophost_wait(int sock, unsigned long deadline)
 {
-	struct caller_handshake *new_hshk;
-	int pair[2];
-	if (!self)
-		return -1;
+	struct pollfd pfd;
+	long wait;
+	int r;
 
-	if (self->num_hshks >= OPHOST_MAXHANDSHAKES)
-		return 0;
+	while (1)
+	{
+		wait = deadline - ophost_clock();
+		if (wait <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		pfd.fd	    = sock;
+		pfd.events  = POLLIN;
+		pfd.revents = 0;
+		r = poll(&pfd, 1, wait);
+		if (r > 0)
+			return 0;
+		else if (r == -1 && errno != EINTR)
+			return -1;
+	}
+}
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+/* send len bytes of buf with count fds attached, in one message */
+static int ophost_send_fds(int sock, void *buf, int len,
+			   int *fds, unsigned int count)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		size_t align;
+		char buf[CMSG_SPACE(OPMSG_MAXFDS * sizeof(int))];
+	} ctl;
+
+	if (count == 0 || count > OPMSG_MAXFDS)
 		return -1;
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctl, 0, sizeof(ctl));
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+	msg.msg_iov	   = &iov;
+	msg.msg_iovlen	   = 1;
+	msg.msg_control	   = ctl.buf;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len	 = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
 
-	/* send to caller through operator relay */
-	if (eslib_sock_send_fd(self->relay, pair[0])) {
-		close(pair[0]);
-		close(pair[1]);
+	if (sendmsg(sock, &msg, MSG_DONTWAIT|MSG_NOSIGNAL) != len)
 		return -1;
+	return 0;
+}
+
+/*
+ * receive up to len bytes into buf, and any fds that came with it.
+ * returns recvmsg result, fds are only set if it's > 0
+ */
+static int ophost_recv_fds(int sock, void *buf, int len,
+			   int *fds, unsigned int *count)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		size_t align;
+		char buf[CMSG_SPACE(OPMSG_MAXFDS * sizeof(int))];
+	} ctl;
+	unsigned int n;
+	int retval;
+
+	*count = 0;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+	msg.msg_iov	   = &iov;
+	msg.msg_iovlen	   = 1;
+	msg.msg_control	   = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	retval = recvmsg(sock, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+	if (retval <= 0)
+		return retval;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	for (; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+				|| cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (*count + n > OPMSG_MAXFDS)
+			n = OPMSG_MAXFDS - *count;
+		memcpy(&fds[*count], CMSG_DATA(cmsg), n * sizeof(int));
+		*count += n;
 	}
-	close(pair[0]);
+	return retval;
+}
 
-	/* create handshake */
-	new_hshk = malloc(sizeof(*new_hshk));
-	if (new_hshk == NULL) {
-		eslib_sock_axe(pair[1]);
-		return 0;
+/*
+ * wait for operator to send an fd. a byte without one is operator saying
+ * why not (opproto.h), it's put in errno.
+ * returns
+ * fd
+ * -1 on error, ETIMEDOUT if deadline passed
+ */
+static int ophost_wait_fd(int sock, unsigned long deadline)
+{
+	int fds[OPMSG_MAXFDS];
+	unsigned int count;
+	unsigned int i;
+	unsigned char byte;
+	int retval;
+
+	while (1)
+	{
+		if (ophost_wait(sock, deadline))
+			return -1;
+		retval = ophost_recv_fds(sock, &byte, 1, fds, &count);
+		if (retval == -1 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		for (i = 1; i < count; ++i)
+			close(fds[i]);
+		if (count)
+			return fds[0];
+		if (retval == 1)
+			errno = byte ? byte : ECONNREFUSED;
+		else if (retval == 0)
+			errno = ECONNREFUSED;
+		return -1;
 	}
+}
+
+/*
+ * answer every id in reply with the matching fd, in one message.
+ * a deposit has no ids, only the fds.
+ */
+static int ophost_send_connect(int relay, struct opmsg *reply, int *fds)
+{
+	int size = OPMSG_SIZE(reply->count);
+
+	if (reply->type == OPMSG_DEPOSIT)
+		size = OPMSG_SIZE(0);
+	return ophost_send_fds(relay, reply, size, fds, reply->count);
+}
 
-	memset(new_hshk, 0, sizeof(*new_hshk));
-	new_hshk->socket = pair[1];
-	gettimeofday(&new_hshk->timestamp, NULL);
-	++self->num_hshks;
 
-	/* add to list */
-	new_hshk->next   = self->handshakes;
-	self->handshakes = new_hshk;
+/* ping shares the relay with connections, it may be full for a moment */
+static int ophost_ping(int relay)
+{
+	struct opmsg msg;
+
+	msg.type  = OPMSG_PING;
+	msg.count = 0;
+	if (send(relay, &msg, OPMSG_SIZE(0), MSG_DONTWAIT|MSG_NOSIGNAL)
+			!= (int)OPMSG_SIZE(0))
+		return -1;
 	return 0;
 }
 
 
 /*
- * deallocate handshake, and update list,
- * returns previous node.
+ * a full queue for one wakeup is just a burst. if it's still full on the
+ * next one host isn't keeping up, call it busy until half has drained.
+ */
+static void ophost_check_backlog(struct ophost *self, int wakeup)
+{
+	int full = self->num_hshks >= OPHOST_MAXHANDSHAKES;
+
+	if (wakeup) {
+		if (full && self->full)
+			self->backlog = 1;
+		self->full = full;
+	}
+	if (self->num_hshks <= OPHOST_MAXHANDSHAKES / 2)
+		self->backlog = 0;
+}
+
+/* let operator know when we fill up, and when there is room again */
+static void ophost_tell_busy(struct ophost *self)
+{
+	struct opmsg msg;
+	int busy = self->busy || self->backlog;
+
+	if (busy == self->told_busy)
+		return;
+	msg.type  = OPMSG_BUSY;
+	msg.count = busy;
+	if (send(self->relay, &msg, OPMSG_SIZE(0), MSG_DONTWAIT|MSG_NOSIGNAL)
+			== (int)OPMSG_SIZE(0))
+		self->told_busy = busy;
+}
+
+
+/* new connection is ready for ophost_handshake, at the back of the line */
+static void ophost_add_handshake(struct ophost *self, int sock,
+				 unsigned int tag)
+{
+	unsigned int idx;
+
+	if (self->num_hshks >= OPHOST_READYSIZE || tag >= OPMSG_MAXTAGS) {
+		eslib_sock_axe(sock); /* can't happen */
+		return;
+	}
+	idx = (self->ready_head + self->num_hshks) % OPHOST_READYSIZE;
+	self->ready[idx]    = sock;
+	self->readytag[idx] = tag;
+	++self->num_hshks;
+}
+
+
+/*
+ *  create the new af_unix connections for every id in reply and
+ *  send those fds back to callers through operator. reply is
+ *  emptied. if we run out of fds, the rest of the ids are not
+ *  answered and those callers time out.
  *
- * note: this invalidates hshk and prev,
- * they should be updated immediately after call
- * */
-static struct caller_handshake *ophost_handshake_destroy(struct ophost *self,
-				       struct caller_handshake *prev,
-				       struct caller_handshake *hshk)
-{
-	if (!hshk || !self)
-		return NULL;
+ *  note: this is a socketpair, so checking credentials at time
+ *  of connection through SO_PEERCRED will not be very useful
+ *  for host trying to authenticate a caller.
+ */
+static int ophost_create_callerhandshakes(struct ophost *self,
+					  struct opmsg *reply)
+{
+	int fds[OPMSG_MAXFDS];
+	int keep[OPMSG_MAXFDS];
+	unsigned int count;
+	unsigned int i;
+	int pair[2];
+	int retval = 0;
+
+	if (!self)
+		return -1;
+
+	for (count = 0; count < reply->count; ++count) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+			break;
+		fds[count]  = pair[0];
+		keep[count] = pair[1];
+	}
+	reply->count = count;
+	if (count == 0)
+		return -1;
 
-	if (prev) {
-		prev->next = hshk->next;
-		free(hshk);
-		hshk = prev; /* rewind */
+	/* send to callers through operator relay */
+	if (ophost_send_connect(self->relay, reply, fds)) {
+		for (i = 0; i < count; ++i)
+			close(keep[i]);
+		retval = -1;
+		count  = 0;
 	}
-	else {  /* removing at front of list */
-		self->handshakes = hshk->next;
-		free(hshk);
-		hshk = NULL;
+	for (i = 0; i < reply->count; ++i)
+		close(fds[i]);
+	reply->count = 0;
+
+	/* create handshakes, deposits are for the registered name */
+	for (i = 0; i < count; ++i) {
+		if (reply->type == OPMSG_DEPOSIT)
+			ophost_add_handshake(self, keep[i], 0);
+		else
+			ophost_add_handshake(self, keep[i],
+					     OPMSG_TAG(reply->id[i]));
 	}
-	if (self->num_hshks)
-		--self->num_hshks;
-	return hshk;
+	return retval;
+}
+
+
+/* fill in a deposit of count new connections for operators stock */
+static int ophost_deposit(struct ophost *self, unsigned int count)
+{
+	struct opmsg deposit;
+
+	if (count > OPMSG_MAXFDS)
+		count = OPMSG_MAXFDS;
+	if (self->num_hshks + count > OPHOST_MAXHANDSHAKES)
+		count = OPHOST_MAXHANDSHAKES - self->num_hshks;
+	if (count == 0)
+		return 0;
+	deposit.type  = OPMSG_DEPOSIT;
+	deposit.count = count;
+	return ophost_create_callerhandshakes(self, &deposit);
 }
 
 
 /*
  *  accept new connections by processing connection requests.
- *  operator sends host a connection request 'R',
- *  we respond by creating a socketpair and send half
- *  back to caller through operator relay
+ *  operator sends host numbered connection requests on relay,
+ *  we respond by creating a socketpair for each and send halves back
+ *  to callers through operator relay, along with the request numbers.
+ *  everything queued is answered with as few messages as possible.
  *
  *  as we cannot call connect across namespace without a bind mount.
  */
 int ophost_accept(struct ophost *self)
 {
-	struct timeval tmr;
+	struct opmsg msg;
+	struct opmsg reply;
+	int fds[OPMSG_MAXFDS];
+	unsigned int nfds;
+	unsigned int k;
+	uint64_t ticks;
 	int i;
 	int retval;
-	char msg;
-	const char a_ok = 'K';
 
 	if (!self)
 		return -1;
 
-	/* send ping back to operator
-	 * TODO make this optional and in it's own function
-	 * and make timeout customizable through cfg file
+	/* send ping back to operator when timer says it's due
+	 * TODO make timeout customizable through cfg file
 	 * if operator goes down we could possibly
 	 * handle that by going into some kind of reconnect loop
 	 */
-	gettimeofday(&tmr, NULL);
-	if (eslib_ms_elapsed(tmr, self->last_ack, OPHOST_PINGDELAY)) {
-		if (send(self->socket, &a_ok, 1, MSG_DONTWAIT) != 1) {
+	if (read(self->timer, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+		if (ophost_ping(self->relay) == 0)
+			gettimeofday(&self->last_ack, NULL);
+		else if (errno != EAGAIN) /* relay is full, try next time */
+			return -1;
+	}
+
+	/* direct connections from callers who could reach our path */
+	for (i = 0; self->direct != -1 && i < OPHOST_MAXACCEPT; ++i)
+	{
+		if (self->num_hshks >= OPHOST_MAXHANDSHAKES)
+			break;
+		retval = accept4(self->direct, NULL, NULL, SOCK_CLOEXEC);
+		if (retval == -1)
+			break;
+		ophost_add_handshake(self, retval, 0);
+	}
+
+	/* process requests, a full batch may go past MAXHANDSHAKES */
+	reply.type  = OPMSG_CONNECT;
+	reply.count = 0;
+	for (i = 0; i < OPHOST_MAXACCEPT; ++i)
+	{
+		if (self->num_hshks + reply.count >= OPHOST_MAXHANDSHAKES)
+			break;
+
+		retval = ophost_recv_fds(self->relay, &msg, sizeof(msg),
+					 fds, &nfds);
+		if (retval == -1 && errno == EINTR)
+			continue;
+		else if (retval == -1 && errno == EAGAIN)
+			break;
+		else if (retval <= 0) /* operator went away */
 			return -1;
+
+		if (retval == (int)OPMSG_SIZE(1) && msg.type == OPMSG_DELIVER) {
+			/* callers made these, they are ready to use */
+			for (k = 0; k < nfds; ++k)
+				ophost_add_handshake(self, fds[k],
+						     OPMSG_TAG(msg.id[0]));
+			continue;
 		}
-		memcpy(&self->last_ack, &tmr, sizeof(tmr));
+		for (k = 0; k < nfds; ++k) /* not expecting any */
+			close(fds[k]);
+
+		if (retval == (int)OPMSG_SIZE(0)
+				&& msg.type == OPMSG_REFILL) {
+			if (ophost_deposit(self, msg.count))
+				goto hshk_err;
+			continue;
+		}
+		else if (retval < (int)OPMSG_SIZE(0)
+				|| msg.type != OPMSG_REQUEST
+				|| msg.count > OPMSG_MAXFDS
+				|| retval != (int)OPMSG_SIZE(msg.count)) {
+			printf("ophost_accept recv'd bad operator message\n");
+			continue;
+		}
+
+		printf("[%u] host got %u conn requests\n", getpid(), msg.count);
+		for (k = 0; k < msg.count; ++k) {
+			reply.id[reply.count++] = msg.id[k];
+			if (reply.count < OPMSG_MAXFDS)
+				continue;
+			if (ophost_create_callerhandshakes(self, &reply))
+				goto hshk_err;
+		}
+	}
+	if (reply.count && ophost_create_callerhandshakes(self, &reply))
+		goto hshk_err;
+	ophost_check_backlog(self, 1);
+	ophost_tell_busy(self);
+	return 0;
+
+hshk_err:
+	printf("error creating caller handshake\n");
+	return -1;
+}
+
+
+int ophost_fd(struct ophost *self)
+{
+	return self->pollfd;
+}
+
+int ophost_watch(struct ophost *self, int fd,
+		 int (*cb)(struct ophost *self, int fd,
+			   unsigned int events, void *arg),
+		 void *arg)
+{
+	struct ophost_watch *w;
+
+	if (self == NULL || cb == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	w = malloc(sizeof(*w));
+	if (w == NULL)
+		return -1;
+	w->fd  = fd;
+	w->cb  = cb;
+	w->arg = arg;
+	if (ophost_poll_add(self, fd, w)) {
+		free(w);
+		return -1;
+	}
+	w->next = self->watches;
+	self->watches = w;
+	return 0;
+}
+
+/* an event for it may still be pending, it's freed after the wakeup */
+int ophost_unwatch(struct ophost *self, int fd)
+{
+	struct ophost_watch **iter;
+	struct ophost_watch *w;
+
+	for (iter = &self->watches; *iter; iter = &(*iter)->next) {
+		if ((*iter)->fd != fd)
+			continue;
+		w = *iter;
+		*iter = w->next;
+		epoll_ctl(self->pollfd, EPOLL_CTL_DEL, fd, NULL);
+		w->cb	= NULL;
+		w->next = self->unwatched;
+		self->unwatched = w;
+		return 0;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+static void ophost_free_unwatched(struct ophost *self)
+{
+	struct ophost_watch *w;
+	while (self->unwatched)
+	{
+		w = self->unwatched;
+		self->unwatched = w->next;
+		free(w);
+	}
+}
+
+/* accept and hand every new caller to on_caller, or to workers */
+static int ophost_run_accept(struct ophost *self,
+		int (*on_caller)(struct ophost *self, int caller,
+				 unsigned int tag, void *arg),
+		void *arg)
+{
+	unsigned int tag;
+	int caller;
+	int r;
+
+	if (ophost_accept(self))
+		return -1;
+	if (self->numworkers) {
+		ophost_distribute(self);
+		return 0;
+	}
+	while ((caller = ophost_handshake_tag(self, &tag)) != -1)
+	{
+		r = on_caller(self, caller, tag, arg);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+/* relay and direct stay readable while there's no room to accept them */
+static int ophost_pause(struct ophost *self, int pause)
+{
+	if (pause == self->paused)
+		return 0;
+	if (pause) {
+		epoll_ctl(self->pollfd, EPOLL_CTL_DEL, self->relay, NULL);
+		if (self->direct != -1)
+			epoll_ctl(self->pollfd, EPOLL_CTL_DEL, self->direct,
+				  NULL);
+	}
+	else if (ophost_poll_add(self, self->relay, NULL)
+			|| (self->direct != -1
+			    && ophost_poll_add(self, self->direct, NULL))) {
+		return -1;
+	}
+	self->paused = pause;
+	return 0;
+}
+
+/*
+ * connections left after distribute wait for a worker to take one, that
+ * worker writes roomfd. look again after asking, it may have been first.
+ */
+static int ophost_wait_room(struct ophost *self)
+{
+	if (self->num_hshks) {
+		__atomic_store_n(&self->waitroom, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		ophost_distribute(self);
+	}
+	return ophost_pause(self, self->num_hshks >= OPHOST_MAXHANDSHAKES);
+}
+
+int ophost_run(struct ophost *self,
+	       int (*on_caller)(struct ophost *self, int caller,
+				unsigned int tag, void *arg),
+	       void *arg)
+{
+	struct epoll_event evs[OPHOST_MAXEVENTS];
+	struct ophost_watch *w;
+	int accept = 1; /* callers may be waiting from before */
+	int count;
+	int i;
+	int r = 0;
+
+	if (self == NULL || (on_caller == NULL && self->numworkers == 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (1)
+	{
+		if (accept) {
+			r = ophost_run_accept(self, on_caller, arg);
+			if (r)
+				break;
+		}
+		ophost_free_unwatched(self);
+		if (self->numworkers && ophost_wait_room(self))
+			return -1;
+
+		count = epoll_wait(self->pollfd, evs, OPHOST_MAXEVENTS, -1);
+		if (count == -1 && errno == EINTR)
+			continue;
+		else if (count == -1)
+			return -1;
+		accept = 0;
+		for (i = 0; i < count; ++i) {
+			w = evs[i].data.ptr;
+			if (w == NULL) {
+				accept = 1;
+				continue;
+			}
+			if (w->cb == NULL) /* unwatched during this wakeup */
+				continue;
+			r = w->cb(self, w->fd, evs[i].events, w->arg);
+			if (r)
+				goto out;
+		}
+	}
+out:
+	ophost_free_unwatched(self);
+	return r;
+}
+
+
+int ophost_set_workers(struct ophost *self, unsigned int count)
+{
+	unsigned int i;
+
+	if (self == NULL || self->numworkers || count == 0
+			|| count > OPHOST_MAXWORKERS) {
+		errno = EINVAL;
+		return -1;
+	}
+	self->workers = calloc(count, sizeof(struct ophost_worker));
+	if (self->workers == NULL)
+		return -1;
+	for (i = 0; i < count; ++i) {
+		self->workers[i].eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if (self->workers[i].eventfd == -1)
+			goto fail;
+	}
+	self->roomfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (self->roomfd == -1)
+		goto fail;
+	if (ophost_poll_add(self, self->roomfd, NULL)) {
+		close(self->roomfd);
+		goto fail;
+	}
+	self->numworkers = count;
+	return 0;
+fail:
+	while (i--)
+		close(self->workers[i].eventfd);
+	free(self->workers);
+	self->workers = NULL;
+	return -1;
+}
+
+/* queue has one producer (distribute) and one consumer (take) */
+static unsigned int ophost_worker_load(struct ophost_worker *w)
+{
+	return w->tail - ophost_load(&w->head);
+}
+
+int ophost_distribute(struct ophost *self)
+{
+	struct ophost_worker *w;
+	unsigned int fed[OPHOST_MAXWORKERS / 32];
+	unsigned int best;
+	unsigned int load;
+	unsigned int tag;
+	unsigned int i, k;
+	eventfd_t val;
+	int count = 0;
+
+	if (self == NULL || self->numworkers == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	eventfd_read(self->roomfd, &val); /* looking at every queue now */
+	memset(fed, 0, sizeof(fed));
+	while (self->num_hshks)
+	{
+		/* least loaded, ties go round robin */
+		best = self->nextworker;
+		load = ophost_worker_load(&self->workers[best]);
+		for (i = 1; i < self->numworkers && load; ++i) {
+			k = (self->nextworker + i) % self->numworkers;
+			if (ophost_worker_load(&self->workers[k]) < load) {
+				best = k;
+				load = ophost_worker_load(&self->workers[k]);
+			}
+		}
+		if (load >= OPHOST_WORKERQ)
+			break; /* all full */
+		self->nextworker = (best + 1) % self->numworkers;
+
+		w = &self->workers[best];
+		w->q[w->tail % OPHOST_WORKERQ] = ophost_handshake_tag(self,
+								      &tag);
+		w->qtag[w->tail % OPHOST_WORKERQ] = tag;
+		ophost_store(&w->tail, w->tail + 1);
+		fed[best / 32] |= 1U << (best % 32);
+		++count;
+	}
+
+	/* one wakeup per worker that got something */
+	for (i = 0; i < self->numworkers; ++i) {
+		if (fed[i / 32] & (1U << (i % 32)))
+			eventfd_write(self->workers[i].eventfd, 1);
+	}
+	return count;
+}
+
+int ophost_worker_fd(struct ophost *self, unsigned int worker)
+{
+	if (self == NULL || worker >= self->numworkers) {
+		errno = EINVAL;
+		return -1;
+	}
+	return self->workers[worker].eventfd;
+}
+
+int ophost_worker_take(struct ophost *self, unsigned int worker,
+		       unsigned int *tag)
+{
+	struct ophost_worker *w;
+	eventfd_t val;
+	int fd;
+
+	if (self == NULL || worker >= self->numworkers) {
+		errno = EINVAL;
+		return -1;
+	}
+	w = &self->workers[worker];
+	if (ophost_load(&w->tail) == w->head) {
+		/* clear wakeup before the last look, anything queued after
+		 * this writes it again */
+		eventfd_read(w->eventfd, &val);
+		if (ophost_load(&w->tail) == w->head) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	fd = w->q[w->head % OPHOST_WORKERQ];
+	if (tag)
+		*tag = w->qtag[w->head % OPHOST_WORKERQ];
+	ophost_store(&w->head, w->head + 1);
+
+	/* accepting thread may be waiting for this room */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&self->waitroom, __ATOMIC_RELAXED)
+			&& __atomic_exchange_n(&self->waitroom, 0,
+					       __ATOMIC_ACQ_REL))
+		eventfd_write(self->roomfd, 1);
+	return fd;
+}
+
+
+/* listen on path, and tell operator about it */
+int ophost_publish(struct ophost *self, char *path)
+{
+	struct sockaddr_un addr;
+	struct opmsg msg;
+	struct stat st;
+	unsigned int len;
+	int sock;
+
+	if (self == NULL || path == NULL || self->direct != -1
+			|| self->replica) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = strnlen(path, OPMSG_MAXPATH);
+	if (len == 0 || len >= OPMSG_MAXPATH || path[0] != '/') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+	addr.sun_family = AF_UNIX;
+	sock = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
+	/* left behind by a previous run */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))
+			|| listen(sock, OPHOST_MAXHANDSHAKES)) {
+		printf("publish %s: %s\n", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	msg.type  = OPMSG_PUBLISH;
+	msg.count = len + 1;
+	memcpy(msg.id, path, len + 1);
+	if (send(self->relay, &msg, OPMSG_SIZE(0) + len + 1,
+				MSG_DONTWAIT|MSG_NOSIGNAL)
+			!= (int)(OPMSG_SIZE(0) + len + 1)) {
+		close(sock);
+		unlink(path);
+		return -1;
+	}
+	if (ophost_poll_add(self, sock, NULL)) {
+		close(sock);
+		unlink(path);
+		return -1;
+	}
+	self->direct = sock;
+	strncpy(self->direct_path, path, sizeof(self->direct_path)-1);
+	return 0;
+}
+
+
+/* name is sent in place of ids, none drops the tag */
+static int ophost_send_name(struct ophost *self, unsigned int tag,
+			    char *name, unsigned int len)
+{
+	struct opmsg msg;
+	int size = OPMSG_SIZE(0);
+
+	msg.type  = OPMSG_NAME;
+	msg.count = tag;
+	if (name) {
+		memcpy(msg.id, name, len + 1);
+		size += len + 1;
+	}
+	if (send(self->relay, &msg, size, MSG_DONTWAIT|MSG_NOSIGNAL) != size)
+		return -1;
+	return 0;
+}
+
+int ophost_add_name(struct ophost *self, char *name)
+{
+	unsigned int len;
+	unsigned int tag;
+
+	if (self == NULL || name == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = strnlen(name, OPHOST_MAXNAME);
+	if (len == 0 || len >= OPHOST_MAXNAME) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (tag = 1; tag < OPMSG_MAXTAGS && self->tags[tag]; ++tag)
+		;
+	if (tag >= OPMSG_MAXTAGS) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (ophost_send_name(self, tag, name, len))
+		return -1;
+	self->tags[tag] = 1;
+	return tag;
+}
+
+int ophost_remove_name(struct ophost *self, unsigned int tag)
+{
+	if (self == NULL || tag == 0 || tag >= OPMSG_MAXTAGS
+			|| !self->tags[tag]) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ophost_send_name(self, tag, NULL, 0))
+		return -1;
+	self->tags[tag] = 0;
+	return 0;
+}
+
+
+int ophost_busy(struct ophost *self, int busy)
+{
+	if (self == NULL) {
+		errno = EINVAL;
+		return -1;
 	}
+	self->busy = (busy != 0);
+	ophost_tell_busy(self);
+	if (self->told_busy != (self->busy || self->backlog))
+		return -1;
+	return 0;
+}
 
-	/* process requests */
-	for (i = 0; i < OPHOST_MAXACCEPT; ++i)
-	{
-		if (self->num_hshks >= OPHOST_MAXHANDSHAKES)
-			return 0;
 
-		retval = recv(self->socket, &msg, 1, MSG_DONTWAIT);
-		if (retval == -1 && (errno == EINTR || errno == EAGAIN))
-			continue;
-		else if (retval == -1)
-			return -1;
-		else if (msg == 'R') { /* connection request */
-			printf("[%u] host got conn request...\n", getpid());
-			if (ophost_create_callerhandshake(self)) {
-				printf("error creating caller handshake\n");
-				return -1;
-			}
-		}
-		else {
-			printf("ophost_accept recv'd bad operator message\n");
-		}
+/* ask operator to keep count connections ready for callers */
+int ophost_stock(struct ophost *self, unsigned int count)
+{
+	struct opmsg msg;
+
+	if (self == NULL) {
+		errno = EINVAL;
+		return -1;
 	}
+	msg.type  = OPMSG_STOCK;
+	msg.count = count;
+	if (send(self->relay, &msg, OPMSG_SIZE(0), MSG_DONTWAIT|MSG_NOSIGNAL)
+			!= (int)OPMSG_SIZE(0))
+		return -1;
 	return 0;
 }
 
 
 /*
- * return the first new connection in list
+ * return the oldest new connection
  * sets errno to EAGAIN if no more handshakes
  */
 int ophost_handshake(struct ophost *self)
+{
+	return ophost_handshake_tag(self, NULL);
+}
+
+int ophost_handshake_tag(struct ophost *self, unsigned int *tag)
 {
 	int ret;
-	struct caller_handshake *hshk;
 
 	if (self == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
-	hshk = self->handshakes;
-
-	if (!hshk) {
+	if (self->num_hshks == 0) {
 		errno = EAGAIN;
 		return -1;
 	}
 
-	ret = hshk->socket;
-	ophost_handshake_destroy(self, NULL, hshk);
+	ret = self->ready[self->ready_head];
+	if (tag)
+		*tag = self->readytag[self->ready_head];
+	self->ready_head = (self->ready_head + 1) % OPHOST_READYSIZE;
+	--self->num_hshks;
+	if (self->backlog) {
+		ophost_check_backlog(self, 0);
+		ophost_tell_busy(self);
+	}
 	return ret;
 }
 
+int ophost_handshake_many(struct ophost *self, int *fds, unsigned int *tags,
+			  unsigned int count)
+{
+	unsigned int i;
+
+	if (self == NULL || fds == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (count > self->num_hshks)
+		count = self->num_hshks;
+	for (i = 0; i < count; ++i) {
+		fds[i] = self->ready[self->ready_head];
+		if (tags)
+			tags[i] = self->readytag[self->ready_head];
+		self->ready_head = (self->ready_head + 1) % OPHOST_READYSIZE;
+	}
+	self->num_hshks -= count;
+	if (self->backlog) {
+		ophost_check_backlog(self, 0);
+		ophost_tell_busy(self);
+	}
+	return count;
+}
+
+
+/*
+ * hosts that published a path are linked in OP_DIRECT_DIR by name,
+ * if we can reach it there's no need to go through operator.
+ */
+static int ophost_connect_direct(char *hostname)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int sock;
+
+	if (strchr(hostname, '/') || hostname[0] == '.')
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+				OP_DIRECT_DIR, hostname)
+			>= (int)sizeof(addr.sun_path))
+		return -1;
+	/* most hosts don't publish, one lstat is cheaper than a socket */
+	if (lstat(addr.sun_path, &st))
+		return -1;
+	sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
 
 /* connect to a registered host */
 int ophost_connect(char *hostname)
 {
 	char msg[OPHOST_MAXNAME];
 	struct sockaddr_un addr;
-	struct timeval tmr, start;
+	unsigned long deadline;
 	unsigned int len;
-	int retval;
 	int sock = -1;
 	int fd = -1;
 
 	if (hostname == NULL)
 		return -1;
+	fd = ophost_connect_direct(hostname);
+	if (fd != -1)
+		return fd;
 
 	memset(&addr, 0, sizeof(addr));
 	strncpy(addr.sun_path, OP_REQ_PATH, sizeof(addr.sun_path)-1);
@@ -209,6 +1037,7 @@ int ophost_connect(char *hostname)
 		return -1;
 	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
 		printf("operator connect: %s\n", strerror(errno));
+		close(sock);
 		return -1;
 	}
 
@@ -221,27 +1050,13 @@ int ophost_connect(char *hostname)
 		goto fail;
 	}
 
-	/* setup timer */
-	gettimeofday(&start, NULL);
-	memcpy(&tmr, &start, sizeof(tmr));
-
 	/* response should be a half of a socketpair */
-	fd = -1;
-	while(!eslib_ms_elapsed(tmr, start, OPHOST_HSHKDELAY))
-	{
-		gettimeofday(&tmr, NULL);
-		retval = eslib_sock_recv_fd(sock, &fd);
-		if (retval == 0)
-			break;
-		else if (retval == -1 && errno != EAGAIN) {
-			printf("recv_fd failed\n");
-			goto fail;
-		}
-
-		usleep(1000); /* 1ms */
-	}
-	if (fd == -1)
+	deadline = ophost_clock() + OPHOST_HSHKDELAY;
+	fd = ophost_wait_fd(sock, deadline);
+	if (fd == -1) {
+		printf("recv_fd: %s\n", strerror(errno));
 		goto fail;
+	}
 
 	eslib_sock_axe(sock);
 	return fd;
@@ -253,12 +1068,369 @@ fail:
 }
 
 
-static struct ophost *ophost_create(int opsock, int relay)
+int ophost_connect_start(char *hostname)
+{
+	char msg[OPHOST_MAXNAME];
+	struct sockaddr_un addr;
+	unsigned int len;
+	const char byte = 'F';
+	int pair[2];
+	int sock;
+	int fd;
+
+	if (hostname == NULL)
+		return -1;
+
+	/* direct connection goes through a socketpair, so it finishes the
+	 * same way as one from operator */
+	fd = ophost_connect_direct(hostname);
+	if (fd != -1) {
+		if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, pair)) {
+			close(fd);
+			return -1;
+		}
+		if (ophost_send_fds(pair[1], (void *)&byte, 1, &fd, 1)) {
+			close(pair[0]);
+			pair[0] = -1;
+		}
+		close(pair[1]);
+		close(fd);
+		return pair[0];
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	strncpy(addr.sun_path, OP_REQ_PATH, sizeof(addr.sun_path)-1);
+	addr.sun_family = AF_UNIX;
+	sock = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
+	/* EAGAIN if operator's backlog is full */
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		goto fail;
+
+	strncpy(msg, hostname, OPHOST_MAXNAME-1);
+	msg[OPHOST_MAXNAME-1] = '\0';
+	len = strnlen(msg, OPHOST_MAXNAME-1) + 1;
+	if (send(sock, msg, len, MSG_DONTWAIT|MSG_NOSIGNAL) != (int)len)
+		goto fail;
+	return sock;
+
+fail:
+	close(sock);
+	return -1;
+}
+
+int ophost_connect_finish(int sock)
+{
+	int fds[OPMSG_MAXFDS];
+	unsigned int count;
+	unsigned int i;
+	unsigned char byte;
+	int retval;
+
+	retval = ophost_recv_fds(sock, &byte, 1, fds, &count);
+	if (retval == -1 && (errno == EAGAIN || errno == EINTR)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	eslib_sock_axe(sock);
+	for (i = 1; i < count; ++i)
+		close(fds[i]);
+	if (count == 0) {
+		/* byte says why, unless operator just hung up */
+		errno = (retval == 1 && byte) ? byte : ECONNREFUSED;
+		return -1;
+	}
+	return fds[0];
+}
+
+
+/*
+ * make the connection ourselves and have operator pass one half to host,
+ * no waiting on host or operator.
+ */
+int ophost_connect_nowait(char *hostname)
+{
+	char msg[OPHOST_MAXNAME];
+	struct sockaddr_un addr;
+	unsigned int len;
+	int pair[2];
+	int sock;
+
+	if (hostname == NULL)
+		return -1;
+	sock = ophost_connect_direct(hostname);
+	if (sock != -1)
+		return sock;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, pair))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	strncpy(addr.sun_path, OP_REQ_PATH, sizeof(addr.sun_path)-1);
+	addr.sun_family = AF_UNIX;
+	sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		goto fail;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		printf("operator connect: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	/* hostname request, with hosts half attached */
+	strncpy(msg, hostname, OPHOST_MAXNAME-1);
+	msg[OPHOST_MAXNAME-1] = '\0';
+	len = strnlen(msg, OPHOST_MAXNAME-1) + 1;
+	if (ophost_send_fds(sock, msg, len, &pair[1], 1)) {
+		printf("send error: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	close(sock);
+	close(pair[1]);
+	return pair[0];
+
+fail:
+	if (sock != -1)
+		close(sock);
+	close(pair[0]);
+	close(pair[1]);
+	return -1;
+}
+
+
+struct ophost_session *ophost_session_open()
+{
+	struct ophost_session *self;
+	struct sockaddr_un addr;
+
+	self = malloc(sizeof(*self));
+	if (self == NULL)
+		return NULL;
+	memset(self, 0, sizeof(*self));
+	memset(&addr, 0, sizeof(addr));
+	strncpy(addr.sun_path, OP_REQ_PATH, sizeof(addr.sun_path)-1);
+	addr.sun_family = AF_UNIX;
+	self->socket = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (self->socket == -1)
+		goto fail;
+	if (connect(self->socket, (struct sockaddr *)&addr, sizeof(addr))) {
+		printf("operator connect: %s\n", strerror(errno));
+		goto fail;
+	}
+	if (send(self->socket, OPSESS_OPEN, sizeof(OPSESS_OPEN), MSG_NOSIGNAL)
+			!= sizeof(OPSESS_OPEN))
+		goto fail;
+	return self;
+fail:
+	if (self->socket != -1)
+		close(self->socket);
+	free(self);
+	return NULL;
+}
+
+int ophost_session_send(struct ophost_session *self, char *hostname)
+{
+	struct opsess_req req;
+
+	if (hostname == NULL)
+		return -1;
+	if (self->sent - self->taken >= OPHOST_SESSWINDOW) {
+		errno = EAGAIN;
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	strncpy(req.name, hostname, OPHOST_MAXNAME-1);
+	if (send(self->socket, &req, sizeof(req), MSG_NOSIGNAL)
+			!= sizeof(req))
+		return -1;
+	++self->sent;
+	return 0;
+}
+
+/* wait until deadline for one reply, put it in it's slot */
+static int ophost_session_read(struct ophost_session *self,
+			       unsigned long deadline)
+{
+	struct opsess_reply reply;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		size_t align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	unsigned int idx;
+	int fd = -1;
+	int r;
+
+	if (ophost_wait(self->socket, deadline))
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base	   = &reply;
+	iov.iov_len	   = sizeof(reply);
+	msg.msg_iov	   = &iov;
+	msg.msg_iovlen	   = 1;
+	msg.msg_control	   = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	r = recvmsg(self->socket, &msg, MSG_WAITALL|MSG_CMSG_CLOEXEC);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (r > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET
+			&& cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	if (r != sizeof(reply)) {
+		if (r == 0)
+			errno = ECONNRESET;
+		else if (r > 0)
+			errno = EPROTO;
+		goto fail;
+	}
+
+	/* anything not waiting on a reply was given up on */
+	if (reply.seq - self->taken >= self->sent - self->taken)
+		goto drop;
+	idx = reply.seq % OPHOST_SESSWINDOW;
+	if (self->ready[idx])
+		goto drop;
+	self->fd[idx]	  = fd;
+	self->status[idx] = reply.status;
+	self->ready[idx]  = 1;
+	if (reply.status == 0 && fd == -1)
+		self->status[idx] = EPROTO;
+	return 0;
+drop:
+	if (fd != -1)
+		close(fd);
+	return 0;
+fail:
+	if (fd != -1)
+		close(fd);
+	return -1;
+}
+
+int ophost_session_recv(struct ophost_session *self)
+{
+	unsigned int idx = self->taken % OPHOST_SESSWINDOW;
+	unsigned long deadline;
+
+	if (self->taken == self->sent) {
+		errno = EINVAL;
+		return -1;
+	}
+	deadline = ophost_clock() + OPHOST_HSHKDELAY;
+	while (!self->ready[idx])
+	{
+		if (ophost_session_read(self, deadline))
+			goto giveup;
+	}
+	self->ready[idx] = 0;
+	++self->taken;
+	if (self->status[idx]) {
+		errno = self->status[idx];
+		return -1;
+	}
+	return self->fd[idx];
+
+giveup:
+	/* a late reply is dropped */
+	++self->taken;
+	return -1;
+}
+
+int ophost_session_connect(struct ophost_session *self, char *hostname)
+{
+	if (self->taken != self->sent) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (ophost_session_send(self, hostname))
+		return -1;
+	return ophost_session_recv(self);
+}
+
+int ophost_connect_many(char **hostnames, int *fds, int *status,
+			unsigned int count)
+{
+	struct opsess_req reqs[OPHOST_SESSWINDOW];
+	unsigned int order[OPHOST_SESSWINDOW]; /* hostname index by slot */
+	struct ophost_session *sess = NULL;
+	unsigned int connected = 0;
+	unsigned int i, k, n;
+	int err = 0;
+
+	for (i = 0; i < count; ++i) {
+		status[i] = 0;
+		fds[i] = ophost_connect_direct(hostnames[i]);
+		if (fds[i] != -1)
+			++connected;
+		else if (sess == NULL)
+			sess = ophost_session_open();
+	}
+	if (connected == count)
+		return connected;
+	if (sess == NULL) {
+		err = errno;
+		goto fail;
+	}
+
+	i = 0;
+	while (i < count || sess->taken != sess->sent)
+	{
+		/* everything that fits in the window goes out in one send */
+		n = 0;
+		for (; i < count && sess->sent + n - sess->taken
+					< OPHOST_SESSWINDOW; ++i) {
+			if (fds[i] != -1)
+				continue;
+			memset(&reqs[n], 0, sizeof(reqs[n]));
+			strncpy(reqs[n].name, hostnames[i], OPHOST_MAXNAME-1);
+			order[(sess->sent + n) % OPHOST_SESSWINDOW] = i;
+			++n;
+		}
+		if (n && send(sess->socket, reqs, n * sizeof(reqs[0]),
+					MSG_NOSIGNAL) != (int)(n * sizeof(reqs[0]))) {
+			/* whatever wasn't answered gets this */
+			err = errno;
+			break;
+		}
+		sess->sent += n;
+		if (sess->taken == sess->sent)
+			continue;
+		k = order[sess->taken % OPHOST_SESSWINDOW];
+		fds[k] = ophost_session_recv(sess);
+		if (fds[k] == -1)
+			status[k] = errno;
+		else
+			++connected;
+	}
+	ophost_session_close(sess);
+fail:
+	for (i = 0; i < count; ++i) {
+		if (fds[i] == -1 && status[i] == 0)
+			status[i] = err ? err : ECONNREFUSED;
+	}
+	return connected;
+}
+
+void ophost_session_close(struct ophost_session *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < OPHOST_SESSWINDOW; ++i) {
+		if (self->ready[i] && self->status[i] == 0)
+			close(self->fd[i]);
+	}
+	close(self->socket);
+	free(self);
+}
+
+
+static struct ophost *ophost_create(int relay)
 {
 	struct ophost *host = NULL;
-	const char a_ok = 'K';
+	struct itimerspec ts;
 
-	if (opsock == -1 || relay == -1)
+	if (relay == -1)
 		return NULL;
 
 	host = malloc(sizeof(*host));
@@ -268,29 +1440,50 @@ static struct ophost *ophost_create(int opsock, int relay)
 	memset(host, 0, sizeof(*host));
 	gettimeofday(&host->time_created, NULL); /* setup timestamps */
 	memcpy(&host->last_ack,	&host->time_created, sizeof(host->last_ack));
-	host->socket  = opsock;
 	host->relay   = relay;
+	host->direct  = -1;
+
+	/* everything ophost_accept handles shows up on pollfd */
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_sec     = OPHOST_PINGDELAY / 1000;
+	ts.it_value.tv_nsec    = (OPHOST_PINGDELAY % 1000) * 1000000;
+	ts.it_interval	       = ts.it_value;
+	host->pollfd = epoll_create1(EPOLL_CLOEXEC);
+	host->timer  = timerfd_create(CLOCK_MONOTONIC,
+				      TFD_NONBLOCK|TFD_CLOEXEC);
+	if (host->pollfd == -1 || host->timer == -1
+			|| timerfd_settime(host->timer, 0, &ts, NULL)
+			|| ophost_poll_add(host, relay, NULL)
+			|| ophost_poll_add(host, host->timer, NULL)) {
+		printf("ophost_create: %s\n", strerror(errno));
+		goto fail;
+	}
 
 	/* send initial ack back to operator to activate host */
-	if (send(opsock, &a_ok, 1, MSG_DONTWAIT) != 1) {
+	if (ophost_ping(relay)) {
 		printf("ophost_create: ack failed.\n");
-		free(host);
-		return NULL;
+		goto fail;
 	}
 
 	return host;
+fail:
+	if (host->pollfd != -1)
+		close(host->pollfd);
+	if (host->timer != -1)
+		close(host->timer);
+	free(host);
+	return NULL;
 }
 
 
 /* register host with operator */
-struct ophost *ophost_register(char *hostname)
+static struct ophost *ophost_register_as(char *hostname, int replica)
 {
 	int sock;
-	int relay;
-	int retval;
+	int relay = -1;
 	struct sockaddr_un addr;
-	char msg[OPHOST_MAXNAME+sizeof(int)];
-	struct timeval tmr, stamp;
+	char msg[OPHOST_MAXNAME+sizeof(OPREG_REPLICA)];
+	unsigned long deadline;
 	struct ophost *newhost = NULL;
 	int len;
 
@@ -302,8 +1495,7 @@ struct ophost *ophost_register(char *hostname)
 	memset(&addr, 0, sizeof(addr));
 	strcpy(addr.sun_path, OP_REG_PATH);
 	addr.sun_family = AF_UNIX;
-	gettimeofday(&stamp, NULL);
-	memcpy(&tmr, &stamp, sizeof(stamp));
+	deadline = ophost_clock() + OPHOST_HSHKDELAY;
 
 	/* connect to operator */
 	sock = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -320,37 +1512,30 @@ struct ophost *ophost_register(char *hostname)
 	strncpy(msg, hostname, OPHOST_MAXNAME-1);
 	msg[OPHOST_MAXNAME-1] = '\0';
 	len = strnlen(msg, OPHOST_MAXNAME-1) + 1;
+	if (replica) {
+		memcpy(&msg[len], OPREG_REPLICA, sizeof(OPREG_REPLICA));
+		len += sizeof(OPREG_REPLICA);
+	}
 	if (send(sock, msg, len, MSG_DONTWAIT) != len) {
 		printf("send: %s\n", strerror(errno));
 		goto fail;
 	}
 
 	/* wait for relay */
-	relay = -1;
-	while(!eslib_ms_elapsed(tmr, stamp, OPHOST_HSHKDELAY))
-	{
-		gettimeofday(&tmr, NULL);
-		retval = eslib_sock_recv_fd(sock, &relay);
-		if (retval == 0) /* got it */
-			break;
-		else if (retval == -1 && errno != EAGAIN) {
-			printf("recv relay error: %s\n", strerror(errno));
-			goto fail;
-		}
-
-		usleep(1000); /* 1ms */
-	}
+	relay = ophost_wait_fd(sock, deadline);
 	if (relay == -1) {
-		printf("ophost handshake timeout\n");
+		printf("recv relay error: %s\n", strerror(errno));
 		goto fail;
 	}
 
-	/* allocate new host struct */
-	newhost = ophost_create(sock, relay);
+	/* allocate new host struct, operator is done with sock */
+	newhost = ophost_create(relay);
 	if (newhost == NULL) {
 		printf("ophost_create error\n");
 		goto fail;
 	}
+	close(sock);
+	newhost->replica = replica;
 	return newhost;
 fail:
 	close(sock);
@@ -359,27 +1544,50 @@ fail:
 
 }
 
+struct ophost *ophost_register(char *hostname)
+{
+	return ophost_register_as(hostname, 0);
+}
+
+struct ophost *ophost_register_replica(char *hostname)
+{
+	return ophost_register_as(hostname, 1);
+}
+
 
 int ophost_destroy(struct ophost *self)
 {
-	struct caller_handshake *tmp;
+	unsigned int i;
+	int fd;
 
 	if (self == NULL)
 		return -1;
 
-	eslib_sock_axe(self->socket);
 	eslib_sock_axe(self->relay);
-	self->socket  = -1;
 	self->relay   = -1;
+	if (self->direct != -1) {
+		close(self->direct);
+		unlink(self->direct_path);
+		self->direct = -1;
+	}
 
 	/* destroy handshakes */
-	while(self->handshakes)
-	{
-		tmp = self->handshakes;
-		self->handshakes = tmp->next;
-		eslib_sock_axe(tmp->socket);
-		free(tmp);
+	while (self->num_hshks)
+		eslib_sock_axe(ophost_handshake(self));
+	for (i = 0; i < self->numworkers; ++i) {
+		while ((fd = ophost_worker_take(self, i, NULL)) != -1)
+			eslib_sock_axe(fd);
+		close(self->workers[i].eventfd);
 	}
+	if (self->numworkers)
+		close(self->roomfd);
+	free(self->workers);
+
+	while (self->watches)
+		ophost_unwatch(self, self->watches->fd);
+	ophost_free_unwatched(self);
+	close(self->pollfd);
+	close(self->timer);
 
 	free(self);
 	return 0;
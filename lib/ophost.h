@@ -5,36 +5,157 @@
 #ifndef OPHOST_H__
 #define OPHOST_H__
 
+#include "opproto.h"
+
 struct timeval;
-/* represents a new connection that is being processed */
-struct caller_handshake
+struct ophost_watch;
+
+#define OPHOST_MAXWORKERS 256
+#define OPHOST_WORKERQ	  256 /* connections queued per worker thread */
+
+/* connections on their way to one worker thread, see ophost_set_workers */
+struct ophost_worker
 {
-	struct timeval timestamp; /* time of creation */
-	struct caller_handshake *next;
-	int socket;
+	int q[OPHOST_WORKERQ];
+	unsigned char qtag[OPHOST_WORKERQ];
+	unsigned int head; /* atomic, advanced by worker */
+	unsigned int tail; /* atomic, advanced by accepting thread */
+	int eventfd;	   /* readable when q may have something */
 };
 
+/* new connections waiting for ophost_handshake, a batch from operator
+ * can land on top of OPHOST_MAXHANDSHAKES */
+#define OPHOST_READYSIZE (OPHOST_MAXHANDSHAKES + OPMSG_MAXFDS)
 
 struct ophost
 {
 	char name[OPHOST_MAXNAME];
-	struct caller_handshake *handshakes;
+	int ready[OPHOST_READYSIZE]; /* ring, oldest connection first */
+	unsigned char readytag[OPHOST_READYSIZE]; /* name each is for */
+	unsigned int ready_head;
 	unsigned int num_hshks;
+	char tags[OPMSG_MAXTAGS]; /* in use, see ophost_add_name */
 	struct timeval time_created;
 	struct timeval last_ack;
-	int socket; /* main line to operator */
-	int relay;  /* relay new connections through operator */
+	int relay;  /* only line to operator, see opproto.h */
+	int replica; /* shares name with others, ophost_register_replica */
+	int busy;      /* set with ophost_busy */
+	int told_busy; /* what operator last heard */
+	int full;      /* ready queue was full after last ophost_accept */
+	int backlog;   /* and still full after this one, see ophost_busy */
+	int direct; /* published listening socket, -1 if none */
+	char direct_path[OPMSG_MAXPATH];
+	int pollfd; /* epoll, readable when ophost_accept has work */
+	int timer;  /* timerfd, readable when a ping is due */
+	struct ophost_watch *watches;	/* application fds for ophost_run */
+	struct ophost_watch *unwatched; /* freed after current wakeup */
+	struct ophost_worker *workers;
+	unsigned int numworkers;
+	unsigned int nextworker;
+	int roomfd;	       /* eventfd, written when waitroom is taken */
+	unsigned int waitroom; /* atomic, ophost_run is waiting for room */
+	int paused; /* relay and direct left out of pollfd, no room for them */
 };
 
 
 /*
  * returns
  * af_unix socket connected to hostname
- * -1 on error
+ * -1 on error, errno is from operator if it refused (see opproto.h)
  */
 int ophost_connect(char *hostname);
 
 
+/*
+ * ophost_connect in two steps, for event loops. start returns right away
+ * with a socket that becomes readable when the connection is ready (or
+ * it failed), then finish collects it. start's socket is closed by
+ * finish unless it returns EAGAIN. operator limits how many requests
+ * each user can have in flight (64), those past it are refused.
+ *
+ * start returns
+ * socket to poll for input
+ * -1 on error, EAGAIN if operator is too busy to accept
+ *
+ * finish returns
+ * af_unix socket connected to hostname
+ * -1 on error, EAGAIN if not ready yet
+ */
+int ophost_connect_start(char *hostname);
+int ophost_connect_finish(int sock);
+
+
+/*
+ * like ophost_connect, but caller makes the connection and operator
+ * passes the other end to host. returns right away, writes are buffered
+ * until host picks it up. if hostname doesn't exist or won't take it,
+ * the connection hangs up.
+ *
+ * returns
+ * af_unix socket for hostname
+ * -1 on error
+ */
+int ophost_connect_nowait(char *hostname);
+
+
+/*
+ * connect to count hosts at once. operator asks them all together, so
+ * this takes about as long as the slowest one instead of the sum.
+ * fds[i] is connected to hostnames[i], or -1 with an errno value in
+ * status[i] (ENOENT no such host).
+ * returns
+ * number of hosts connected
+ */
+int ophost_connect_many(char **hostnames, int *fds, int *status,
+			unsigned int count);
+
+
+/*
+ * session, one connection to operator for many requests.
+ * requests can be sent back to back, up to OPHOST_SESSWINDOW waiting on
+ * a reply. replies are handed back in the order requests were sent.
+ */
+#define OPHOST_SESSWINDOW 64
+struct ophost_session
+{
+	int socket;
+	unsigned int sent;  /* requests sent */
+	unsigned int taken; /* replies handed back */
+	int fd[OPHOST_SESSWINDOW];     /* by request number */
+	int status[OPHOST_SESSWINDOW];
+	char ready[OPHOST_SESSWINDOW]; /* reply arrived */
+};
+
+/*
+ * returns
+ * newly malloc'd session
+ * NULL on error
+ */
+struct ophost_session *ophost_session_open();
+
+/*
+ * queue a request, doesn't wait for the reply.
+ * returns
+ *  0 if ok
+ * -1 on error, errno is EAGAIN if window is full
+ */
+int ophost_session_send(struct ophost_session *self, char *hostname);
+
+/*
+ * wait for the reply to the oldest request not yet handed back.
+ * returns
+ * af_unix socket connected to hostname
+ * -1 on error, errno is from operator if it refused (ENOENT no such host)
+ */
+int ophost_session_recv(struct ophost_session *self);
+
+/* send and recv one request, window must be empty */
+int ophost_session_connect(struct ophost_session *self, char *hostname);
+
+/* connections that were never handed back are closed */
+void ophost_session_close(struct ophost_session *self);
+
+
 /*
  * returns
  * newly malloc'd and registered host
@@ -42,6 +163,18 @@ int ophost_connect(char *hostname);
  */
 struct ophost *ophost_register(char *hostname);
 
+/*
+ * register as one of several hosts serving hostname, all of them must
+ * use this and run as the same user. operator spreads callers over them,
+ * whoever has the fewest waiting first and round robin otherwise, so
+ * adding replicas adds capacity under the same name. replicas can't
+ * ophost_publish, that would let callers skip the spreading.
+ * returns
+ * newly malloc'd and registered host
+ * NULL on error, or if hostname is taken by a host that is not a replica
+ */
+struct ophost *ophost_register_replica(char *hostname);
+
 
 /*
  *  free any heap memory and shut down host
@@ -53,11 +186,114 @@ int ophost_destroy(struct ophost *host);
 
 /*
  *  accept connection requests, create handshake
+ *  also accepts direct connections if host is published.
  *   0 if ok
  *  -1 on error
  */
 int ophost_accept(struct ophost *self);
 
+/*
+ *  returns
+ *  fd that polls readable when ophost_accept has something to do,
+ *  new requests, direct callers, or a ping is due. don't read it.
+ */
+int ophost_fd(struct ophost *self);
+
+/*
+ *  wait for callers and pass each one to on_caller with the tag of the
+ *  name it asked for (see ophost_add_name), and events on fds
+ *  added with ophost_watch to their callback. sleeps when there is
+ *  nothing to do. callbacks may watch and unwatch fds. on_caller can be
+ *  NULL if there are workers (ophost_set_workers), callers go to them.
+ *  returns
+ *  first nonzero value a callback returned
+ *  -1 if operator went away, or on error
+ */
+int ophost_run(struct ophost *self,
+	       int (*on_caller)(struct ophost *self, int caller,
+				unsigned int tag, void *arg),
+	       void *arg);
+
+/*
+ *  have ophost_run call cb with epoll events when fd is ready for input.
+ *  fd is not closed by ophost, unwatch it first.
+ *   0 if ok
+ *  -1 on error
+ */
+int ophost_watch(struct ophost *self, int fd,
+		 int (*cb)(struct ophost *self, int fd,
+			   unsigned int events, void *arg),
+		 void *arg);
+int ophost_unwatch(struct ophost *self, int fd);
+
+/*
+ *  spread new connections over count worker threads. one thread runs
+ *  ophost_accept and then ophost_distribute (ophost_run with NULL
+ *  on_caller does both), each connection goes to the worker with the
+ *  fewest queued. workers sleep on ophost_worker_fd and take their
+ *  connections with ophost_worker_take, no locks involved.
+ *  ophost_worker_fd and ophost_worker_take are the only calls that are
+ *  safe from worker threads, each worker only uses it's own number.
+ *  connections that don't fit wait with ophost until workers catch up,
+ *  ophost_run sleeps until a worker takes one.
+ *   0 if ok
+ *  -1 on error
+ */
+int ophost_set_workers(struct ophost *self, unsigned int count);
+
+/*
+ *  returns
+ *  number of connections passed to workers
+ *  -1 on error
+ */
+int ophost_distribute(struct ophost *self);
+
+/*
+ *  returns
+ *  fd that polls readable when worker may have connections, don't read it
+ *  -1 on error
+ */
+int ophost_worker_fd(struct ophost *self, unsigned int worker);
+
+/*
+ *  tag is set to the name caller asked for, if not NULL.
+ *  returns
+ *  oldest connection queued for worker
+ *  -1 on error, EAGAIN if there are none
+ */
+int ophost_worker_take(struct ophost *self, unsigned int worker,
+		       unsigned int *tag);
+
+/*
+ *  listen on path, and have operator point callers at it. callers that
+ *  can reach path (same mount namespace) connect straight to host,
+ *  everyone else still goes through operator. path is removed by
+ *  ophost_destroy. operator only publishes sockets owned by hosts uid.
+ *  not for replicas.
+ *   0 if ok
+ *  -1 on error
+ */
+int ophost_publish(struct ophost *self, char *path);
+
+/*
+ *  serve another name on this registration, no extra fds or pings.
+ *  connections for it come out of ophost_handshake_tag and friends with
+ *  the returned tag, the registered name is tag 0. operator ignores a
+ *  name that is already taken, it's callers get ENOENT.
+ *  returns
+ *  tag, 1 to OPMSG_MAXTAGS-1
+ *  -1 on error, ENOSPC if host has no more tags
+ */
+int ophost_add_name(struct ophost *self, char *name);
+
+/*
+ *  stop serving the name tag was returned for, tag can be reused.
+ *  callers already on their way may still show up with it.
+ *   0 if ok
+ *  -1 on error
+ */
+int ophost_remove_name(struct ophost *self, unsigned int tag);
+
 /*
  *  returns
  *  -1 on error
@@ -65,4 +301,41 @@ int ophost_accept(struct ophost *self);
  */
 int ophost_handshake(struct ophost *self);
 
+/* same, tag is set to the name caller asked for */
+int ophost_handshake_tag(struct ophost *self, unsigned int *tag);
+
+/*
+ *  take up to count new connections at once, oldest first.
+ *  tags can be NULL, or gets the name each one asked for.
+ *  returns
+ *  -1 on error
+ *   number of connections put in fds, 0 if there are none
+ */
+int ophost_handshake_many(struct ophost *self, int *fds, unsigned int *tags,
+			  unsigned int count);
+
+/*
+ *  tell operator host can't take more callers. they are refused with
+ *  EBUSY right away, or go to another replica, instead of waiting on
+ *  host until they time out. ophost_accept does this on it's own when
+ *  OPHOST_MAXHANDSHAKES connections are still waiting to be taken on
+ *  two wakeups in a row, and clears it once half of them are taken.
+ *   0 if ok
+ *  -1 on error, try again later
+ */
+int ophost_busy(struct ophost *self, int busy);
+
+/*
+ *  ask operator to keep count connections ready (up to it's limit),
+ *  callers get one of those right away instead of waiting for
+ *  ophost_accept. operator asks for refills as they are used, and
+ *  ophost_accept sends them. 0 turns stock off.
+ *
+ *  stocked connections come out of ophost_handshake when they are
+ *  made, the caller may show up much later or not at all.
+ *   0 if ok
+ *  -1 on error
+ */
+int ophost_stock(struct ophost *self, unsigned int count);
+
 #endif
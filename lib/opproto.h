@@ -0,0 +1,138 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ *
+ * operator <--> host relay protocol
+ *
+ * the relay is an AF_UNIX SOCK_SEQPACKET pair the operator hands to a host
+ * when it registers. every message on it is one struct opmsg.
+ *
+ * operator sends OPMSG_REQUEST with a list of request ids, host answers
+ * with OPMSG_CONNECT carrying ids and one half of a new socketpair for
+ * each, as SCM_RIGHTS in the same order. both sides coalesce everything
+ * they have pending into as few messages as they can. many requests can
+ * be in flight, replies may arrive in any order and are matched to their
+ * caller by id.
+ *
+ * a host can also keep a stock of connections with the operator, so
+ * callers are answered without waiting on host. host sets how many with
+ * OPMSG_STOCK, operator asks for more with OPMSG_REFILL as they are used,
+ * and host answers with OPMSG_DEPOSIT carrying that many fds. these three
+ * carry a number in count and no ids.
+ *
+ * OPMSG_DELIVER passes host connections that callers made themselves,
+ * one fd and one id that only carries the tag. host can use them right
+ * away.
+ *
+ * OPMSG_PUBLISH carries a null terminated path in place of ids, count is
+ * it's length including the terminator. operator links it in
+ * OP_DIRECT_DIR under hosts name, so callers in the same mount namespace
+ * can connect directly.
+ *
+ * OPMSG_NAME has host serve another name on the same relay, count is a
+ * tag from 1 to OPMSG_MAXTAGS-1 and a null terminated name takes the place
+ * of ids. a message without a name drops the tag. request ids carry the
+ * tag of the name the caller asked for in their top bits, 0 is the name
+ * host registered with. stock and published paths are only for that one.
+ *
+ * OPMSG_BUSY with a nonzero count says host can't take more callers,
+ * operator refuses new ones (EBUSY) or picks another replica until host
+ * sends one with count 0. requests not yet sent to host are refused too,
+ * ones it already has are still answered with OPMSG_CONNECT or time out.
+ * stock is still handed out.
+ *
+ * OPMSG_PING is host saying it's still there, count is 0 and no ids.
+ * host is evicted if it misses a few, requests are not sent until the
+ * first one arrives. the registration socket is closed once the relay
+ * has been handed over, this is the only line between the two.
+ */
+
+#ifndef OPPROTO_H__
+#define OPPROTO_H__
+
+#include <stddef.h>
+
+#define OPMSG_REQUEST 'R' /* operator wants a new connection */
+#define OPMSG_CONNECT 'C' /* host replies with connection fds */
+#define OPMSG_STOCK   'S' /* host wants count connections kept ready */
+#define OPMSG_REFILL  'F' /* operator wants count more for stock */
+#define OPMSG_DEPOSIT 'D' /* host sends count fds for stock */
+#define OPMSG_DELIVER 'P' /* operator passes on caller made connections */
+#define OPMSG_PUBLISH 'L' /* host is listening on a path */
+#define OPMSG_NAME    'N' /* host serves another name */
+#define OPMSG_PING    'K' /* host is alive */
+#define OPMSG_BUSY    'B' /* host is full, or has room again */
+#define OPMSG_MAXFDS  253 /* SCM_MAX_FD, kernel limit per message */
+#define OPMSG_MAXPATH 108 /* sun_path, longest OPMSG_PUBLISH */
+#define OPMSG_MAXTAGS 64  /* names per host, including it's own */
+
+/* request ids, tag of the name asked for above a running number */
+#define OPMSG_TAGSHIFT 24
+#define OPMSG_IDMASK   ((1U << OPMSG_TAGSHIFT) - 1)
+#define OPMSG_TAG(id_) ((id_) >> OPMSG_TAGSHIFT)
+
+struct opmsg
+{
+	unsigned int type;
+	unsigned int count;
+	unsigned int id[OPMSG_MAXFDS]; /* chosen by operator, echoed by host */
+};
+
+/* bytes on the wire for a message with count ids */
+#define OPMSG_SIZE(count_) \
+	(offsetof(struct opmsg, id) + (count_) * sizeof(unsigned int))
+#define OPMSG_HAS_IDS(type_) \
+	((type_) == OPMSG_REQUEST || (type_) == OPMSG_CONNECT \
+	 || (type_) == OPMSG_DELIVER)
+
+
+/*
+ * a host registers by sending it's null terminated name to OP_REG_PATH.
+ * a replica sends OPREG_REPLICA (with it's terminator) right after, and
+ * shares the name with other replicas of the same user. operator spreads
+ * callers over them.
+ */
+#define OPREG_REPLICA "replica"
+
+
+/*
+ * caller replies
+ *
+ * a caller normally sends one hostname and gets one byte back with the
+ * fd attached. when operator can't connect it the byte comes alone and
+ * is an errno value saying why:
+ *
+ *  ENOENT	 no such host
+ *  ENOTCONN	 host registered but hasn't pinged yet
+ *  EBUSY	 host said it's full (OPMSG_BUSY), or operator is full
+ *  EDQUOT	 caller has too many requests in flight
+ *  ETIMEDOUT	 host didn't answer in time
+ *  ECONNREFUSED host went away, or something else went wrong
+ */
+
+
+/*
+ * caller sessions
+ *
+ * a caller normally sends one hostname and gets one fd back. a caller
+ * that opens with OPSESS_OPEN keeps it's connection to OP_REQ_PATH as a
+ * session, credentials are checked once. after that every struct
+ * opsess_req names a host and gets one struct opsess_reply back, with the
+ * connection attached if status is 0. otherwise status is an errno value,
+ * as above.
+ * replies carry the number of the request they answer, counting from 0,
+ * and can arrive in any order.
+ */
+#define OPSESS_OPEN "\0session" /* can't be a hostname */
+
+struct opsess_req
+{
+	char name[OPHOST_MAXNAME]; /* null terminated, rest is padding */
+};
+
+struct opsess_reply
+{
+	unsigned int seq;
+	int status;
+};
+
+#endif
@@ -0,0 +1,191 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "nametable.h"
+
+/* keep load under 3/4 */
+#define nametable_full(self_, count_) ((count_) * 4 >= (self_)->size * 3)
+
+
+/* fnv-1a */
+unsigned int nametable_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	unsigned int i;
+	for (i = 0; i < OPHOST_MAXNAME && name[i] != '\0'; ++i) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+int nametable_init(struct nametable *self, unsigned int size)
+{
+	unsigned int n = 16;
+
+	while (n < size)
+		n <<= 1;
+	self->slots = malloc(n * sizeof(struct nameslot));
+	if (self->slots == NULL)
+		return -1;
+	memset(self->slots, 0, n * sizeof(struct nameslot));
+	self->size  = n;
+	self->count = 0;
+	return 0;
+}
+
+
+void nametable_free(struct nametable *self)
+{
+	free(self->slots);
+	self->slots = NULL;
+	self->size  = 0;
+	self->count = 0;
+}
+
+
+/* zero padded inline copy of name, returns 1 if name did not fit */
+static int nametable_inline(char *out, const char *name)
+{
+	unsigned int i;
+	for (i = 0; i < NAMETABLE_INLINE && name[i] != '\0'; ++i)
+		out[i] = name[i];
+	if (i == NAMETABLE_INLINE)
+		return 1;
+	memset(&out[i], 0, NAMETABLE_INLINE - i);
+	return 0;
+}
+
+
+/* returns slot index of name, or index of empty slot where it belongs */
+static unsigned int nametable_find(struct nametable *self, const char *name,
+				   unsigned int hash)
+{
+	char inl[NAMETABLE_INLINE];
+	unsigned int mask = self->size - 1;
+	unsigned int i = hash & mask;
+	int islong;
+
+	islong = nametable_inline(inl, name);
+	while (self->slots[i].val)
+	{
+		struct nameslot *slot = &self->slots[i];
+		if (slot->hash == hash
+				&& memcmp(slot->name, inl, NAMETABLE_INLINE) == 0
+				&& (!islong || strncmp(slot->key, name,
+						OPHOST_MAXNAME) == 0))
+			return i;
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+
+/* double table size and reinsert everything */
+static int nametable_grow(struct nametable *self)
+{
+	struct nameslot *old = self->slots;
+	unsigned int oldsize = self->size;
+	unsigned int mask;
+	unsigned int i, n;
+
+	self->slots = malloc(oldsize * 2 * sizeof(struct nameslot));
+	if (self->slots == NULL) {
+		self->slots = old;
+		return -1;
+	}
+	memset(self->slots, 0, oldsize * 2 * sizeof(struct nameslot));
+	self->size = oldsize * 2;
+	mask = self->size - 1;
+
+	for (i = 0; i < oldsize; ++i) {
+		if (!old[i].val)
+			continue;
+		n = old[i].hash & mask;
+		while (self->slots[n].val)
+			n = (n + 1) & mask;
+		memcpy(&self->slots[n], &old[i], sizeof(struct nameslot));
+	}
+	free(old);
+	return 0;
+}
+
+
+void *nametable_lookup(struct nametable *self, const char *name)
+{
+	unsigned int i = nametable_find(self, name, nametable_hash(name));
+	return self->slots[i].val;
+}
+
+
+int nametable_insert(struct nametable *self, const char *key, void *val)
+{
+	unsigned int hash;
+	unsigned int i;
+
+	if (val == NULL || key == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (nametable_full(self, self->count + 1)) {
+		if (nametable_grow(self))
+			return -1;
+	}
+
+	hash = nametable_hash(key);
+	i = nametable_find(self, key, hash);
+	if (self->slots[i].val) {
+		errno = EEXIST;
+		return -1;
+	}
+	self->slots[i].hash = hash;
+	self->slots[i].key  = key;
+	self->slots[i].val  = val;
+	nametable_inline(self->slots[i].name, key);
+	++self->count;
+	return 0;
+}
+
+
+void *nametable_remove(struct nametable *self, const char *name)
+{
+	unsigned int mask = self->size - 1;
+	unsigned int i, n, home;
+	void *val;
+
+	i = nametable_find(self, name, nametable_hash(name));
+	val = self->slots[i].val;
+	if (val == NULL)
+		return NULL;
+
+	/* shift back any entry that probed past the hole */
+	n = i;
+	while (1)
+	{
+		n = (n + 1) & mask;
+		if (!self->slots[n].val)
+			break;
+		home = self->slots[n].hash & mask;
+		/* entry stays if it's home lies cyclically in (i, n] */
+		if (i <= n) {
+			if (i < home && home <= n)
+				continue;
+		}
+		else if (i < home || home <= n) {
+			continue;
+		}
+		memcpy(&self->slots[i], &self->slots[n],
+				sizeof(struct nameslot));
+		i = n;
+	}
+	memset(&self->slots[i], 0, sizeof(struct nameslot));
+	--self->count;
+	return val;
+}
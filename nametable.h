@@ -0,0 +1,70 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ *
+ * nametable
+ *
+ * open addressing hash table mapping a name string to an object.
+ * linear probing with backward shift deletion, so there are no tombstones
+ * and lookups stay short after many register/remove cycles.
+ *
+ * the first NAMETABLE_INLINE bytes of each name are kept in the slot, most
+ * lookups never leave the slot array. the full name is only compared
+ * through key when it is too long to fit inline. key must remain valid
+ * for as long as it is in the table, usually it points into val.
+ */
+
+#ifndef NAMETABLE_H__
+#define NAMETABLE_H__
+
+#define NAMETABLE_INLINE 12
+
+/* 32 bytes on 64 bit */
+struct nameslot
+{
+	unsigned int hash;
+	char name[NAMETABLE_INLINE]; /* zero padded, may not be terminated */
+	const char *key;	     /* full name */
+	void *val;		     /* NULL if slot is empty */
+};
+
+struct nametable
+{
+	struct nameslot *slots;
+	unsigned int size;  /* always a power of 2 */
+	unsigned int count;
+};
+
+/*
+ * size is rounded up to a power of 2, table grows as needed.
+ * returns
+ *  0 if ok
+ * -1 on error
+ */
+int nametable_init(struct nametable *self, unsigned int size);
+void nametable_free(struct nametable *self);
+
+/* hash used by the table, full name up to OPHOST_MAXNAME */
+unsigned int nametable_hash(const char *name);
+
+/*
+ * returns
+ * object stored under name
+ * NULL if not found
+ */
+void *nametable_lookup(struct nametable *self, const char *name);
+
+/*
+ * returns
+ *  0 if ok
+ * -1 on error, errno is EEXIST if name is taken
+ */
+int nametable_insert(struct nametable *self, const char *key, void *val);
+
+/*
+ * returns
+ * object that was removed
+ * NULL if not found
+ */
+void *nametable_remove(struct nametable *self, const char *name);
+
+#endif
@@ -16,38 +16,146 @@
 #include <sys/un.h>
 #include <sys/fcntl.h>
 #include <sys/time.h>
-#include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
 #include <syslog.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <errno.h>
 #include <signal.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
 
 #include "eslib/eslib.h"
+#include "nametable.h"
+#include "uidtable.h"
+#include "slab.h"
+#include "uring.h"
+#include "timewheel.h"
+#include "lib/opproto.h"
 
 /* some reasonable limits */
-#define UPDATE_FREQ 12   /* 12 frames per second(ish)*/
-#define MAXACCEPT   100  /* connections to accept per frame */
-#define MAXREG_HSHK 25   /* pending registrations, consumes 1 fd */
-#define MAXREQ_HSHK 25   /* connection request handshakes, consume 1 fd */
-#define MAXHOSTS    150  /* consume 2 fds make sure we're within ulimit -Sn */
+#define MAXEVENTS   64   /* epoll events handled per wakeup */
+#define MAXACCEPT   100  /* connections to accept per wakeup */
+#define REQ_BACKLOG 1024 /* callers waiting to be accepted, up to somaxconn */
+#define MAXREG_HSHK 256  /* pending registrations, consumes 1 fd */
+#define MAXREQ_HSHK 4096 /* connection request handshakes, consume 1 fd */
+#define FDRESERVE   64   /* fds kept free for everything else */
 #define MAXHOSTSPERUSER 5/* default hosts per user, root is unlimited */
+#define MAXREGPERUSER 5  /* pending registrations per user */
+#define MAXREQPERUSER 64 /* pending connection requests per user */
+#define MAXSESSIONS 4096 /* open caller sessions, consume 1 fd */
+#define MAXSESSPERUSER 16/* open caller sessions per user */
+#define SESSQUEUE   16   /* session replies waiting on a full socket */
+#define MAXWORKERS  256  /* worker threads */
+#define URING_SIZE  64   /* io_uring submission queue entries */
+#define RELAY_BATCH 32   /* fds relayed per io_uring submission, x2 sqes */
+#define RELAY_RECV  8    /* host messages received per io_uring submission */
+#define MAXSTOCK    32   /* connections a host can keep ready with operator */
+#define MAXREPLICAS 64   /* hosts sharing one name */
+
+/* initial pool sizes, pools grow as needed up to the limits above.
+ * hosts are limited at runtime by RLIMIT_NOFILE, they consume 1 fd */
+#define POOL_REG_HSHK 32
+#define POOL_REQ_HSHK 256
+#define POOL_HOSTS    256
+#define POOL_SESSIONS 32
+#define POOL_ALIASES  64
 
 /* milliseconds */
 #define OP_REG_TIMEOUT 5000
 #define OP_REQ_TIMEOUT 5000
+#define OP_HOST_TIMEOUT (OPHOST_PINGDELAY * 3) /* no ack, host is evicted */
 
+/* peer is gone, or going */
+#define OPEV_HANGUP (EPOLLRDHUP|EPOLLHUP|EPOLLERR)
+
+
+/*
+ * everything registered with epoll begins with one of these types,
+ * so the event loop can tell what became ready.
+ */
+enum {
+	OPEV_NONE = 0,	       /* removed during this wakeup, ignore */
+	OPEV_REGISTRATION,     /* registration listening socket */
+	OPEV_REQUEST,	       /* request listening socket */
+	OPEV_REGISTR_HSHK,     /* pending registration */
+	OPEV_REQUEST_NAME,     /* caller has not sent hostname yet */
+	OPEV_REQUEST_HSHK,     /* caller waiting on a connection */
+	OPEV_HOST,	       /* registered host, it's relay */
+	OPEV_INBOX,	       /* handshakes passed to a worker */
+	OPEV_URING,	       /* accept completions on io_uring */
+	OPEV_SESSION,	       /* caller session, many requests */
+	OPEV_ALIAS	       /* another name for a host, never watched */
+};
+
+/* request handshake states */
+enum {
+	REQ_WAIT_NAME = 0, /* waiting for caller to send hostname */
+	REQ_WAIT_HOST	   /* host was sent request, waiting for connection */
+};
+
+struct _ophost;
+struct session;
 
 /* struct is shared between register and request protocols */
 struct handshake
 {
+	int evtype;
 	int active;
+	struct slab *pool;	 /* returned here when freed */
+	struct handshake *pnext; /* dead list */
 	struct ucred creds;
-	struct timeval timestamp;
+	struct timer timer;	 /* dropped when this expires */
 	int socket;
 	int visibility; /* (registration only) */
-	pid_t pid; /* 0 if inactive (request only) */
+	int join;	/* (registration only) as a replica, OPREG_REPLICA */
+
+	/* (request only) */
+	int state;
+	struct _ophost *host;	 /* host we are waiting on */
+	unsigned int reqid;	 /* echoed back with the connection */
+	struct handshake *next;	 /* hosts queue of waiting requests */
+	struct handshake *prev;
+	struct session *session; /* NULL if caller is not in a session */
+	unsigned int seq;	 /* sessions request number */
+	int replied;		 /* session was answered */
+	int error;		 /* session is told this if dropped */
+};
+
+
+/*
+ * a caller that keeps it's connection open for many requests (OPSESS_OPEN).
+ * acceptor reads requests and hands them to workers like any other, they
+ * reply on the session socket. socket is closed and the session freed
+ * when the last reference is gone, acceptor holds one while it's open.
+ *
+ * replies come from acceptor and any worker, lock keeps each one whole on
+ * the stream. what the socket won't take waits in out, oldest first, and
+ * acceptor sends the rest on EPOLLOUT. head may be partly sent already.
+ */
+struct session
+{
+	int evtype;
+	int socket;
+	struct ucred creds;
+	unsigned int refs; /* atomic, acceptor + requests in flight */
+	unsigned int seq;  /* next request number */
+	unsigned int buflen;
+	char buf[sizeof(struct opsess_req) * 16]; /* unprocessed requests */
+	pthread_mutex_t lock;
+	struct opsess_reply out[SESSQUEUE];
+	int outfd[SESSQUEUE];  /* our copy, closed once it's sent */
+	unsigned int outhead;
+	unsigned int outlen;
+	unsigned int outsent;  /* bytes of head reply sent */
+	int outwatch;	       /* acceptor is waiting for EPOLLOUT */
 };
 
 
@@ -57,40 +165,202 @@ struct handshake
  */
 struct _ophost
 {
+	int evtype;
 	char name[OPHOST_MAXNAME];
 	struct _ophost *next; /* linked list */
-	int socket;	/* main line to host (send requests here) */
-	int relay;	/* relays new connections back to caller */
+	struct _ophost *prev;
+	int relay;	/* the only line to host, see opproto.h */
 	uid_t uid;
 
-	/* last confirmation ping, 0's if not ready */
-	struct timeval time_created;
-	struct timeval last_ack;
+	/*
+	 * requests waiting for a connection, oldest first. ids are handed
+	 * out in order so replies usually match the head of the queue.
+	 * requests from unsent on have not been sent to host yet, they go
+	 * out together when the worker flushes at the end of a wakeup.
+	 */
+	struct handshake *waiting;
+	struct handshake *waiting_tail;
+	struct handshake *unsent;
+	unsigned int numwaiting;
+	unsigned int nextid;
+	struct _ophost *flushnext; /* workers flush list */
+	int flushing;		   /* on flush list */
+
+	/* connections deposited ahead of time, callers take from the top */
+	int stock[MAXSTOCK];
+	unsigned int numstock;
+	unsigned int stocktarget;  /* host wants this many kept ready */
+	unsigned int restocking;   /* asked for, not deposited yet */
+
+	int published; /* linked in OP_DIRECT_DIR */
+	int busy;      /* host can't take callers right now (OPMSG_BUSY) */
+
+	/*
+	 * replicas share a name, only the first is indexed and it keeps the
+	 * others on a ring. callers are spread over them, see host_pick.
+	 */
+	int replica;		 /* registered with OPREG_REPLICA */
+	struct _ophost *rnext;	 /* ring, points to itself if alone */
+	struct _ophost *rprev;
+	struct _ophost *rcursor; /* (indexed only) next in line */
+
+	/* more names served over the same relay (OPMSG_NAME), by tag */
+	char (*names)[OPHOST_MAXNAME]; /* NULL until host adds one */
+	unsigned int serial; /* tells aliases apart from a later namesake */
+
+	/* evicted if no ping arrives before this expires */
+	struct timer timer;
+	int confirmed; /* first ping received, ready for requests */
+};
+
+
+/*
+ * another name for a host, indexed by the worker that owns the alias.
+ * that is usually not the hosts worker, so requests are handed on to it
+ * by host name. serial and tag are checked there, in case host went away
+ * or dropped the name while a request was on it's way.
+ */
+struct opalias
+{
+	int evtype; /* OPEV_ALIAS */
+	char name[OPHOST_MAXNAME];
+	char host[OPHOST_MAXNAME];
+	unsigned int serial;
+	unsigned int tag;
+};
+
+
+/*
+ * a handshake that has received it's hostname, on it's way from the
+ * acceptor to the worker that owns the name.
+ */
+struct handoff
+{
+	struct handoff *next;
+	int type; /* OPEV_REGISTR_HSHK, OPEV_REQUEST_HSHK or OPEV_ALIAS */
+	int socket;
+	struct ucred creds;
+	unsigned long expires; /* handshake deadline */
+	int pushfd; /* connection caller made for host, or -1 */
+	struct session *session; /* socket belongs to session if set */
+	unsigned int seq;
+	char name[OPHOST_MAXNAME];
+
+	/* request passed on by an alias, or alias to add/remove */
+	unsigned int tag;
+	unsigned int serial; /* 0 if not through an alias */
+	char host[OPHOST_MAXNAME]; /* (alias only) */
+	int remove;		   /* (alias only) */
+	int join;		   /* (registration only) */
+};
+
+
+/*
+ * hosts are sharded across workers by name hash, a worker owns every
+ * host in it's shard and all requests waiting on them. nothing here is
+ * touched by other threads except the inbox.
+ */
+struct opworker
+{
+	struct timewheel timers;    /* request and host deadlines */
+	struct handshake *dead;	    /* freed after current wakeup */
+	struct _ophost *hosts;	    /* registered hosts */
+	struct _ophost *hosts_tail;
+	struct _ophost *removed;    /* freed after current wakeup */
+	struct _ophost *flush;	    /* hosts with unsent requests */
+	struct slab request_pool;
+	struct slab host_pool;
+	struct slab alias_pool;
+	struct nametable names;	 /* hosts and aliases indexed by name */
+	struct uring ring;	 /* batched fd relay, fd is -1 if unused */
+	int epoll;
+	pthread_t thread;
+
+	/* handoffs from acceptor */
+	pthread_mutex_t lock;
+	struct handoff *inbox;
+	struct handoff *inbox_tail;
+	int inboxfd; /* eventfd */
+	int ev_inbox;
 };
 
 
 /*
  * global operator data
+ *
+ * the acceptor owns the listening sockets and handshakes that have not
+ * sent a hostname yet. with one worker, acceptor and worker share a thread
+ * and epoll instance, handoffs are plain function calls.
  */
 struct system_operator
 {
-	struct handshake registr[MAXREG_HSHK];  /* host registrations */
-	struct handshake requests[MAXREQ_HSHK]; /* connection requests */
-	struct _ophost *hosts; /* registered hosts */
+	struct timewheel timers;    /* handshake deadlines */
+	struct handshake *dead;	    /* freed after current wakeup */
+	struct slab registr_pool;
+	struct slab request_pool;
+	struct slab handoff_pool;   /* locked, workers free handoffs */
+	struct slab session_pool;   /* locked, workers drop last reference */
+	struct opworker *workers;
+	unsigned int numworkers;
+
+	/* atomic, requests and registrations are released by workers */
 	unsigned int numhosts;
+	unsigned int numregistr;
+	unsigned int numrequests;
+	unsigned int numstocked;
+	unsigned int numsessions;
+	unsigned int nextserial;
+	/* limits */
+	unsigned int maxhosts;
+	unsigned int maxregistr;
+	unsigned int maxrequests;
+	unsigned int maxstocked;
+	unsigned int maxsessions;
+	unsigned int host_timeout; /* ms, 0 never evicts */
+
+	/* per-uid handshake and host counts, shared by all threads */
+	struct uidtable uids;
+	pthread_mutex_t uidlock;
 
 	/* sockets */
 	int registration; /* register a new host */
 	int request;	  /* request connection to host */
+	int epoll;
+	struct uring ring; /* multishot accept, fd is -1 if using accept */
+
+	/* epoll tags for the sockets above */
+	int ev_registration;
+	int ev_request;
+	int ev_uring;
 };
 struct system_operator  g_operator;
 
 
 static int  operator_update_requests();
+static int  operator_update_request(struct handshake *hshk);
+static void operator_update_caller(struct opworker *w, struct handshake *hshk);
+static void operator_update_relay(struct opworker *w, struct _ophost *host,
+				  unsigned int events);
 static int  operator_update_regconnect();
-static int  operator_update_registration();
-static void operator_update_hosts();
-static int init();
+static void operator_update_uring();
+static int  operator_update_registration(struct handshake *pending);
+static void operator_update_inbox(struct opworker *w);
+static void operator_flush_requests(struct opworker *w);
+static void operator_update_session(struct session *s, unsigned int events);
+static int  session_flush(struct session *s);
+static void session_drop_replies(struct session *s);
+static int  session_create(struct handshake *hshk, char *data,
+			   unsigned int len);
+static int  host_deliver(struct _ophost *host, int fd, unsigned int tag);
+static int  caller_reply(int sock, struct session *s, unsigned int seq,
+			 int fd, int status);
+static void operator_expire_timers(struct opworker *w, int acceptor);
+static int  operator_next_timeout(struct opworker *w, int acceptor);
+static void operator_free_removed(struct opworker *w);
+static void remove_host(struct opworker *w, struct _ophost *host);
+static void handshake_free_dead(struct handshake **dead);
+static int init(unsigned int numworkers, unsigned int maxhosts,
+		unsigned int host_timeout, int uring);
 
 
 char g_errbuf[ESLIB_LOG_MAXMSG];
@@ -115,543 +385,2374 @@ static void operator_signal_setup()
 	signal(SIGTRAP, operator_signal_handler);
 }
 
-int main()
+/*
+ * hand ready event off to whoever owns it
+ */
+static void operator_dispatch(struct opworker *w, struct epoll_event *ev)
 {
-	if (init()) {
-		printf("initialization error\n");
-		return -1;
-	}
-
-	while(1)
+	switch (*(int *)ev->data.ptr)
 	{
+	case OPEV_REGISTRATION:
 		operator_update_regconnect();
-		operator_update_registration();
-		operator_update_hosts();
+		break;
+	case OPEV_REQUEST:
 		operator_update_requests();
-		usleep(999999/UPDATE_FREQ);
+		break;
+	case OPEV_REGISTR_HSHK:
+		operator_update_registration(ev->data.ptr);
+		break;
+	case OPEV_REQUEST_NAME:
+		operator_update_request(ev->data.ptr);
+		break;
+	case OPEV_REQUEST_HSHK:
+		operator_update_caller(w, ev->data.ptr);
+		break;
+	case OPEV_HOST:
+		operator_update_relay(w, ev->data.ptr, ev->events);
+		break;
+	case OPEV_INBOX:
+		operator_update_inbox(w);
+		break;
+	case OPEV_URING:
+		operator_update_uring();
+		break;
+	case OPEV_SESSION:
+		operator_update_session(ev->data.ptr, ev->events);
+		break;
+	case OPEV_NONE:
+		break;
+	default:
+		eslib_logcritical("operator", "unknown event type");
+		break;
 	}
-	return -1;
 }
 
 
-static int init()
+/*
+ * sleep until something is ready, or a handshake is due to expire.
+ * w is NULL for a dedicated acceptor thread.
+ */
+static int operator_loop(struct opworker *w, int acceptor)
 {
+	struct epoll_event events[MAXEVENTS];
+	int epfd = w ? w->epoll : g_operator.epoll;
+	int count;
 	int i;
 
-	/* ignore sigpipe, and friends.. */
-	operator_signal_setup();
-
-	/* global operator instance */
-	memset(&g_operator, 0, sizeof(g_operator));
-	for (i = 0; i < MAXREG_HSHK; ++i)
-		g_operator.registr[i].socket = -1;
-
-	/* create registration socket */
-	g_operator.registration = eslib_sock_create_passive(OP_REG_PATH,
-							    OPHOST_MAXACCEPT);
-	if (g_operator.registration == -1)
-		return -1;
-
-	/* create requests socket */
-	g_operator.request = eslib_sock_create_passive(OP_REQ_PATH,
-						       OPHOST_MAXACCEPT);
-	if (g_operator.request == -1)
-		return -1;
-
-	return 0;
+	while(1)
+	{
+		count = epoll_wait(epfd, events, MAXEVENTS,
+				   operator_next_timeout(w, acceptor));
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			printf("epoll_wait: %s\n", strerror(errno));
+			return -1;
+		}
+		for (i = 0; i < count; ++i)
+			operator_dispatch(w, &events[i]);
+		if (w)
+			operator_flush_requests(w);
+
+		/* nothing can reference the dead anymore */
+		operator_expire_timers(w, acceptor);
+		if (acceptor)
+			handshake_free_dead(&g_operator.dead);
+		if (w) {
+			handshake_free_dead(&w->dead);
+			operator_free_removed(w);
+		}
+	}
+	return -1;
 }
 
+static void *operator_worker_thread(void *arg)
+{
+	operator_loop(arg, 0);
+	eslib_logcritical("operator", "worker thread exited");
+	kill(getpid(), SIGTERM);
+	return NULL;
+}
 
+static void print_usage()
+{
+	printf("usage:\n");
+	printf("operator [-t <threads>] [-m <hosts>] [-k <ms>] [-e]\n");
+	printf("    -t  worker threads, hosts are sharded across them. ");
+	printf("default 1, max %d\n", MAXWORKERS);
+	printf("    -m  maximum registered hosts. ");
+	printf("default is as many as RLIMIT_NOFILE allows\n");
+	printf("    -k  evict hosts that have not pinged for this long. ");
+	printf("default %d, 0 never evicts\n", OP_HOST_TIMEOUT);
+	printf("    -e  plain epoll, don't try io_uring\n");
+}
 
-/*
- * return a new connection
- */
-static int operator_accept_connection(int sock, int nonblock)
+int main(int argc, char *argv[])
 {
-	int newsock;
-	struct sockaddr_un addr;
-	socklen_t addrlen = sizeof(addr);
+	unsigned int numworkers = 1;
+	unsigned int maxhosts = 0;
+	unsigned int host_timeout = OP_HOST_TIMEOUT;
+	unsigned int i;
+	int uring = 1;
+	int opt;
 
-	memset(&addr, 0, sizeof(addr));
-	newsock = accept(sock, (struct sockaddr *)&addr, &addrlen);
-	if (newsock == -1) {
-		if (errno != EAGAIN && errno != EINTR) {
-			printf("operator - accept_connection error: %s",
-					strerror(errno));
+	while ((opt = getopt(argc, argv, "t:m:k:e")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			numworkers = strtoul(optarg, NULL, 10);
+			if (numworkers < 1 || numworkers > MAXWORKERS) {
+				print_usage();
+				return -1;
+			}
+			break;
+		case 'm':
+			maxhosts = strtoul(optarg, NULL, 10);
+			if (maxhosts < 1) {
+				print_usage();
+				return -1;
+			}
+			break;
+		case 'k':
+			host_timeout = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			uring = 0;
+			break;
+		default:
+			print_usage();
+			return -1;
 		}
+	}
+
+	if (init(numworkers, maxhosts, host_timeout, uring)) {
+		printf("initialization error\n");
 		return -1;
 	}
 
+	if (numworkers == 1)
+		return operator_loop(&g_operator.workers[0], 1);
 
-	if (nonblock) {
-		if (eslib_sock_setnonblock(newsock)) {
-			printf("socket: could not set as nonblocking\n");
-			eslib_sock_axe(newsock);
+	for (i = 0; i < numworkers; ++i) {
+		if (pthread_create(&g_operator.workers[i].thread, NULL,
+				   operator_worker_thread,
+				   &g_operator.workers[i])) {
+			printf("pthread_create failed\n");
 			return -1;
 		}
 	}
-
-	return newsock;
+	return operator_loop(NULL, 1);
 }
 
 
-/* return number of handshakes with uid */
-static int handshake_count_uid(struct handshake *hshk,
-			       unsigned int size, uid_t uid)
+/* watch fd for input, ptr is handed back to operator_dispatch */
+static int operator_watch(int epfd, int fd, void *ptr)
 {
-	unsigned int i;
-	int count = 0;
-	for (i = 0; i < size; ++i) {
-		if (hshk[i].active) {
-			if (hshk[i].creds.uid == uid)
-				++count;
-		}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN|EPOLLRDHUP;
+	ev.data.ptr = ptr;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		printf("epoll_ctl add: %s\n", strerror(errno));
+		return -1;
 	}
-	return count;
+	return 0;
 }
 
-
-/* return number of hosts with uid */
-static int hosts_count_uid(struct _ophost *hosts, uid_t uid)
+/* same fd, ptr changes */
+static int operator_rewatch(int epfd, int fd, void *ptr)
 {
-	struct _ophost *host = hosts;
-	int count = 0;
-	while (host)
-	{
-		if (host->uid == uid)
-			++count;
-		host = host->next;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN|EPOLLRDHUP;
+	ev.data.ptr = ptr;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev)) {
+		printf("epoll_ctl mod: %s\n", strerror(errno));
+		return -1;
 	}
-	return count;
+	return 0;
 }
 
-
-/*
- *  listen for new connections on registration socket.
- *  create a new host registration handshake
- */
-static int operator_update_regconnect()
+/* stop watching fd, before it is closed or passed to a worker */
+static void operator_unwatch(int epfd, int fd)
 {
-	int i, p;
-	int sock;
-	struct ucred creds;
-	socklen_t len = sizeof(struct ucred);
+	if (fd == -1)
+		return;
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL))
+		printf("epoll_ctl del: %s\n", strerror(errno));
+}
 
-	/* check for new connections to be handled next frame */
-	for (i = 0; i < MAXACCEPT; ++i)
-	{
-		sock = operator_accept_connection(g_operator.registration, 1);
-		if (sock == -1)
-			break;
 
-		/* peercred gets credentials at time of connect call */
-		if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &creds, &len)){
-			printf("getsockopt: %s\n", strerror(errno));
-			eslib_sock_axe(sock);
-			return -1;
-		}
+/* per-uid counters may be updated by any thread */
+static unsigned int operator_uid_count(uid_t uid, int type)
+{
+	unsigned int count;
+	pthread_mutex_lock(&g_operator.uidlock);
+	count = uidtable_count(&g_operator.uids, uid, type);
+	pthread_mutex_unlock(&g_operator.uidlock);
+	return count;
+}
+static int operator_uid_inc(uid_t uid, int type)
+{
+	int ret;
+	pthread_mutex_lock(&g_operator.uidlock);
+	ret = uidtable_inc(&g_operator.uids, uid, type);
+	pthread_mutex_unlock(&g_operator.uidlock);
+	return ret;
+}
+static void operator_uid_dec(uid_t uid, int type)
+{
+	pthread_mutex_lock(&g_operator.uidlock);
+	uidtable_dec(&g_operator.uids, uid, type);
+	pthread_mutex_unlock(&g_operator.uidlock);
+}
+/* inc only if uid is under max, checked and taken under one lock */
+static int operator_uid_take(uid_t uid, int type, unsigned int max)
+{
+	int ret = -1;
+	pthread_mutex_lock(&g_operator.uidlock);
+	if (uidtable_count(&g_operator.uids, uid, type) < max)
+		ret = uidtable_inc(&g_operator.uids, uid, type);
+	pthread_mutex_unlock(&g_operator.uidlock);
+	return ret;
+}
+/* count moves from one type to the other */
+static void operator_uid_move(uid_t uid, int from, int to)
+{
+	pthread_mutex_lock(&g_operator.uidlock);
+	uidtable_inc(&g_operator.uids, uid, to);
+	uidtable_dec(&g_operator.uids, uid, from);
+	pthread_mutex_unlock(&g_operator.uidlock);
+}
 
-		/* bottleneck registration attempts per uid */
-		if (handshake_count_uid(g_operator.registr,
-					MAXREG_HSHK, creds.uid) > 5) {
-			eslib_sock_axe(sock);
-			return -1;
-		}
 
-		/*
-		 * nonroot uid is limited
-		 * TODO read limits from operator config file
-		 */
-		if (creds.uid != 0) {
-			if (hosts_count_uid(g_operator.hosts, creds.uid)
-					>= MAXHOSTSPERUSER) {
-				printf("uid(%d) at host limit\n", creds.uid);
-				eslib_sock_axe(sock);
-				return -1;
-			}
-		}
-		/* find a free slot */
-		for (p = 0; p < MAXREG_HSHK;) {
-			if (!g_operator.registr[++p].active)
-				break;
-		}
-		if (p >= MAXREG_HSHK)
-			eslib_sock_axe(sock);
-		else {
-			/* create pending registration */
-			memset(&g_operator.registr[p],
-					0, sizeof(struct handshake));
-			g_operator.registr[p].socket = sock;
-			gettimeofday(&g_operator.registr[p].timestamp, NULL);
-			memcpy(&g_operator.registr[p].creds,
-					&creds, sizeof(creds));
-			g_operator.registr[p].active = 1;
-		}
+/* global counters are shared by every thread, plain reads can tear */
+static unsigned int operator_count(unsigned int *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+/* take one if counter is under max, -1 if not */
+static int operator_count_take(unsigned int *counter, unsigned int max)
+{
+	if (__sync_add_and_fetch(counter, 1) > max) {
+		__sync_sub_and_fetch(counter, 1);
+		return -1;
 	}
 	return 0;
 }
 
 
-/* register protocol:
- *
- * pending host sends registration message:
- * 	the desired host name(null terminated string)
- *
- * server acks by sending the relay socket for new connections
- * new host is added to the front of list.
- *
- * the new host will not be sent connection requests until it
- * has sent operator at least one ack, 'K'.
- */
-static int operator_update_registration()
+/* milliseconds on the monotonic clock, wall clock changes don't move it */
+static unsigned long operator_clock()
 {
-	char msg[OPHOST_MAXNAME];
-	char *nameptr;
-	struct _ophost *host;
-	struct handshake *pending;
-	struct timeval tmr;
-	int relay[2]; /* AF_UNIX socket pair */
-	int retval;
-	int len;
-	unsigned int p;
-
-	gettimeofday(&tmr, NULL);
-
-	for (p = 0; p < MAXREG_HSHK; ++p) {
-
-		pending = &g_operator.registr[p];
-		if (!pending->active)
-			continue;
-
-		/* check expiration */
-		if (eslib_ms_elapsed(tmr, pending->timestamp,
-					    OP_REG_TIMEOUT)) {
-			printf("pending connection expired, dropping...\n");
-			goto drop_pending;
-		}
-
-		if (g_operator.numhosts >= MAXHOSTS)
-			continue;
-
-		/* receive host name */
-		retval = recv(pending->socket, msg, sizeof(msg), MSG_DONTWAIT);
-		if (retval == -1 && (errno == EAGAIN || errno == EINTR)) {
-			continue; /* no data to recv */
-		}
-		else if (retval == 0 || retval == -1) {
-			printf("socket error\n");
-			goto drop_pending;
-		}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
 
-		/* validate hostname */
-		if (retval <= 1 || msg[0] == '\0' || msg[retval-1] != '\0') {
-			static time_t t = 0;
-			eslib_logerror_t("operator",
-					 "erroneous hostname", &t, 10);
-			goto drop_pending;
-		}
 
+static int init_worker(struct opworker *w, int epfd)
+{
+	unsigned int shard = POOL_HOSTS / g_operator.numworkers;
 
-		/* find host */
-		host = g_operator.hosts;
-		nameptr = msg;
-		len = strnlen(nameptr, OPHOST_MAXNAME);
-		if (len >= OPHOST_MAXNAME)
-			goto drop_pending;
+	memset(w, 0, sizeof(*w));
+	timewheel_init(&w->timers, operator_clock());
+	w->ring.fd = -1;
+	if (g_operator.ring.fd != -1 && uring_init(&w->ring, URING_SIZE))
+		return -1;
+	if (nametable_init(&w->names, shard * 2))
+		return -1;
+	if (slab_init(&w->host_pool, sizeof(struct _ophost), shard, 0))
+		return -1;
+	if (slab_init(&w->alias_pool, sizeof(struct opalias),
+		      POOL_ALIASES / g_operator.numworkers, 0))
+		return -1;
+	if (slab_init(&w->request_pool, sizeof(struct handshake),
+		      POOL_REQ_HSHK / g_operator.numworkers, 0))
+		return -1;
+	w->inboxfd = -1;
 
-		for (; host; host = host->next)
-			if (strncmp(host->name,	nameptr, len) == 0)
-				goto drop_pending; /* host name in use */
+	/* acceptor calls directly into the worker it shares a thread with */
+	if (epfd != -1) {
+		w->epoll = epfd;
+		return 0;
+	}
 
-		/* name is available */
-		host = malloc(sizeof(*host));
-		if (host == NULL)
-			goto drop_pending;
+	w->epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epoll == -1)
+		return -1;
+	if (pthread_mutex_init(&w->lock, NULL))
+		return -1;
+	w->inboxfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (w->inboxfd == -1)
+		return -1;
+	w->ev_inbox = OPEV_INBOX;
+	return operator_watch(w->epoll, w->inboxfd, &w->ev_inbox);
+}
 
-		memset(host, 0, sizeof(*host));
-		strncpy(host->name, nameptr, len);
 
-		/* ack: create and send relay socket */
-		if (socketpair(AF_UNIX, SOCK_STREAM, 0, relay))
-			goto free_and_drop;
+/*
+ * raise fd limit as far as we are allowed, and split it between pending
+ * handshakes and hosts. maxhosts of 0 means use whatever is left.
+ */
+static int init_limits(unsigned int maxhosts)
+{
+	struct rlimit rlim;
+	unsigned int nofile;
+	unsigned int fit;
 
-		if (eslib_sock_send_fd(pending->socket, relay[1])) {
-			printf("error sending relay fd\n");
-			close(relay[0]);
-			close(relay[1]);
-			goto free_and_drop;
-		}
-		close(relay[1]); /* don't need this half */
-
-
-		/* add to front of list */
-		gettimeofday(&host->time_created, NULL); /* setup timestamps */
-		memcpy(&host->last_ack, &host->time_created,
-					sizeof(host->last_ack));
-		host->socket = pending->socket;
-		host->relay = relay[0];
-		host->next = g_operator.hosts;
-		host->uid = pending->creds.uid;
-		g_operator.hosts = host;
-		++g_operator.numhosts;
-		/* reset pending slot */
-		memset(pending, 0, sizeof(*pending));
-		pending->socket = -1;
-		continue;
-free_and_drop:
-		free(host);
-drop_pending:
-		eslib_sock_axe(pending->socket);
-		memset(pending, 0, sizeof(*pending));
-		pending->socket = -1;
+	if (getrlimit(RLIMIT_NOFILE, &rlim))
+		return -1;
+	if (rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rlim))
+			getrlimit(RLIMIT_NOFILE, &rlim);
+	}
+	nofile = rlim.rlim_cur > 0x7fffffff ? 0x7fffffff : rlim.rlim_cur;
+	if (nofile < FDRESERVE * 4) {
+		printf("RLIMIT_NOFILE(%u) is too low\n", nofile);
+		return -1;
 	}
 
+	g_operator.maxrequests = MAXREQ_HSHK;
+	g_operator.maxregistr  = MAXREG_HSHK;
+	if (g_operator.maxrequests > nofile / 4)
+		g_operator.maxrequests = nofile / 4;
+	if (g_operator.maxregistr > nofile / 16)
+		g_operator.maxregistr = nofile / 16;
+	g_operator.maxstocked = nofile / 8;
+	g_operator.maxsessions = MAXSESSIONS;
+	if (g_operator.maxsessions > nofile / 16)
+		g_operator.maxsessions = nofile / 16;
+
+	fit = nofile - FDRESERVE - g_operator.maxrequests
+			- g_operator.maxregistr - g_operator.maxstocked
+			- g_operator.maxsessions;
+	if (maxhosts == 0)
+		maxhosts = fit;
+	else if (maxhosts > fit)
+		printf("warning: %u hosts may exceed RLIMIT_NOFILE(%u)\n",
+				maxhosts, nofile);
+	g_operator.maxhosts = maxhosts;
 	return 0;
 }
 
-/* find host by name */
-static struct _ophost *host_lookup(char *name)
+
+/* hosts publish here, anything left from a previous run is stale */
+static int init_direct_dir()
 {
-	struct _ophost *host = g_operator.hosts;
-	while (host)
+	char path[OPMSG_MAXPATH];
+	struct dirent *ent;
+	DIR *dir;
+
+	if (mkdir(OP_DIRECT_DIR, 0755) && errno != EEXIST) {
+		printf("mkdir %s: %s\n", OP_DIRECT_DIR, strerror(errno));
+		return -1;
+	}
+	dir = opendir(OP_DIRECT_DIR);
+	if (dir == NULL)
+		return -1;
+	while ((ent = readdir(dir)))
 	{
-		if (strncmp(name, host->name, OPHOST_MAXNAME) == 0)
-			return host;
-		host = host->next;
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", OP_DIRECT_DIR,
+				ent->d_name);
+		unlink(path);
 	}
-	return NULL;
+	closedir(dir);
+	return 0;
 }
 
+/* multishot accept on listening socket, completions come back with tag */
+static int operator_arm_accept(int sock, int *tag)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&g_operator.ring);
+	if (sqe == NULL)
+		return -1;
+	uring_prep_accept_multishot(sqe, sock, SOCK_NONBLOCK|SOCK_CLOEXEC, tag);
+	return 0;
+}
 
 
-/*          (new thread)
- * caller<--><operator><-->host request handshake thread.
- * relays AF_UNIX connection fd from host back to caller.
- *
+/*
+ * uring is 0 to skip io_uring and accept connections on epoll readiness,
+ * otherwise it is used if the kernel supports it.
  */
-static int req_handshake_process(struct handshake *hshk)
+static int init(unsigned int numworkers, unsigned int maxhosts,
+		unsigned int host_timeout, int uring)
 {
-	char msg[OPHOST_MAXNAME];
-	struct _ophost *host = NULL;
-	const char req  = 'R';
-	int retval;
-	int fd;
-	struct timeval tmr;
-
-	/*
-	 * connection request protocol:
-	 *	wait for caller to send hostname
-	 *	send host a connection request message
-	 *	receive new connection fd from host
-	 *	relay new connection fd back to caller
-	 * exit thread.
-	 *
-	 * host and caller can do their own mystical handshake if they
-	 * are so inclined. operator only cares about introducing them.
-	 */
+	unsigned int i;
 
+	/* ignore sigpipe, and friends.. */
+	operator_signal_setup();
 
-	/*
-	 * get hostname
-	 * make sure we received more than a null terminator & 0 is disconnect
-	 */
-	retval = recv(hshk->socket, msg, sizeof(msg), 0);
-	if (retval <= 1) {
+	/* global operator instance */
+	memset(&g_operator, 0, sizeof(g_operator));
+	g_operator.ring.fd = -1;
+	g_operator.host_timeout = host_timeout;
+	timewheel_init(&g_operator.timers, operator_clock());
+	if (init_limits(maxhosts))
+		return -1;
+	if (uring && uring_init(&g_operator.ring, URING_SIZE))
+		printf("io_uring unavailable: %s, using epoll\n",
+				strerror(errno));
+	if (slab_init(&g_operator.registr_pool, sizeof(struct handshake),
+		      POOL_REG_HSHK, 0)
+			|| slab_init(&g_operator.request_pool,
+				     sizeof(struct handshake),
+				     POOL_REQ_HSHK, 0)
+			|| slab_init(&g_operator.handoff_pool,
+				     sizeof(struct handoff),
+				     POOL_REQ_HSHK, numworkers > 1)
+			|| slab_init(&g_operator.session_pool,
+				     sizeof(struct session),
+				     POOL_SESSIONS, numworkers > 1))
+		return -1;
+	if (uidtable_init(&g_operator.uids, 64))
+		return -1;
+	if (pthread_mutex_init(&g_operator.uidlock, NULL))
+		return -1;
+
+	g_operator.epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (g_operator.epoll == -1)
+		return -1;
+
+	g_operator.numworkers = numworkers;
+	g_operator.workers = malloc(numworkers * sizeof(struct opworker));
+	if (g_operator.workers == NULL)
+		return -1;
+	for (i = 0; i < numworkers; ++i) {
+		if (init_worker(&g_operator.workers[i],
+				numworkers == 1 ? g_operator.epoll : -1))
+			return -1;
+	}
+
+	if (init_direct_dir())
+		return -1;
+
+	/* create registration socket */
+	g_operator.registration = eslib_sock_create_passive(OP_REG_PATH,
+							    OPHOST_MAXACCEPT);
+	if (g_operator.registration == -1)
+		return -1;
+
+	/* create requests socket */
+	g_operator.request = eslib_sock_create_passive(OP_REQ_PATH,
+						       REQ_BACKLOG);
+	if (g_operator.request == -1)
+		return -1;
+
+	g_operator.ev_registration = OPEV_REGISTRATION;
+	g_operator.ev_request	   = OPEV_REQUEST;
+	g_operator.ev_uring	   = OPEV_URING;
+	if (g_operator.ring.fd != -1) {
+		if (operator_arm_accept(g_operator.registration,
+					&g_operator.ev_registration)
+				|| operator_arm_accept(g_operator.request,
+						       &g_operator.ev_request)
+				|| uring_submit(&g_operator.ring, 0) == -1)
+			return -1;
+		return operator_watch(g_operator.epoll, g_operator.ring.fd,
+				      &g_operator.ev_uring);
+	}
+	if (operator_watch(g_operator.epoll, g_operator.registration,
+			   &g_operator.ev_registration)
+			|| operator_watch(g_operator.epoll, g_operator.request,
+					  &g_operator.ev_request))
+		return -1;
+
+	return 0;
+}
+
+
+
+/*
+ * return a new nonblocking connection
+ */
+static int operator_accept_connection(int sock)
+{
+	int newsock;
+
+	/* accept4 saves the fcntl calls */
+	newsock = accept4(sock, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+	if (newsock == -1) {
+		if (errno != EAGAIN && errno != EINTR) {
+			printf("operator - accept_connection error: %s",
+					strerror(errno));
+		}
+		return -1;
+	}
+	return newsock;
+}
+
+
+/* worker that owns name */
+static struct opworker *operator_shard(char *name)
+{
+	unsigned int hash;
+	if (g_operator.numworkers == 1)
+		return &g_operator.workers[0];
+	/* nametable uses the low bits, shard on a remix of the whole hash */
+	hash = nametable_hash(name) * 2654435761u;
+	return &g_operator.workers[(hash >> 16) % g_operator.numworkers];
+}
+
+
+/*
+ * cancel handshake deadline, it goes back to the pool after this
+ * wakeup's events have all been dispatched. hshk->socket is not
+ * touched, caller has either closed it or passed it on.
+ */
+static void handshake_release(struct handshake **dead, struct handshake *hshk)
+{
+	timewheel_cancel(&hshk->timer);
+	hshk->evtype = OPEV_NONE;
+	hshk->active = 0;
+	hshk->socket = -1;
+	hshk->pnext  = *dead;
+	*dead = hshk;
+}
+
+static void handshake_free_dead(struct handshake **dead)
+{
+	struct handshake *hshk;
+	while (*dead)
+	{
+		hshk = *dead;
+		*dead = hshk->pnext;
+		slab_free(hshk->pool, hshk);
+	}
+}
+
+/* drop a reference, last one closes the session */
+static void session_put(struct session *s)
+{
+	if (__sync_sub_and_fetch(&s->refs, 1))
+		return;
+	session_drop_replies(s);
+	pthread_mutex_destroy(&s->lock);
+	eslib_sock_axe(s->socket);
+	operator_uid_dec(s->creds.uid, UIDCOUNT_SESSION);
+	__sync_sub_and_fetch(&g_operator.numsessions, 1);
+	slab_free(&g_operator.session_pool, s);
+}
+
+
+static void operator_worker_handoff(struct opworker *w, struct handoff *h);
+
+/* zeroed handoff, local is used if there is only one worker */
+static struct handoff *handoff_alloc(struct handoff *local)
+{
+	struct handoff *h = local;
+	if (g_operator.numworkers > 1) {
+		h = slab_alloc(&g_operator.handoff_pool);
+		if (h == NULL)
+			return NULL;
+	}
+	memset(h, 0, sizeof(*h));
+	return h;
+}
+
+/* pass handoff to the worker that owns h->name */
+static void handoff_post(struct handoff *h)
+{
+	struct opworker *w = operator_shard(h->name);
+
+	if (g_operator.numworkers == 1) {
+		operator_worker_handoff(w, h);
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	if (w->inbox_tail)
+		w->inbox_tail->next = h;
+	else
+		w->inbox = h;
+	w->inbox_tail = h;
+	pthread_mutex_unlock(&w->lock);
+	if (eventfd_write(w->inboxfd, 1))
+		printf("inbox eventfd: %s\n", strerror(errno));
+}
+
+/* names always fit OPHOST_MAXNAME with their terminator, cut if not */
+static void name_copy(char *dst, const char *src)
+{
+	size_t len = strnlen(src, OPHOST_MAXNAME - 1);
+
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+/*
+ * acceptor is done with this handshake, pass it along to the worker
+ * that owns the requested name. handshake slot is released.
+ * pushfd belongs to the worker if this succeeds.
+ */
+static int operator_handoff(struct handshake *hshk, int type, char *name,
+			    int pushfd)
+{
+	struct handoff local;
+	struct handoff *h;
+
+	h = handoff_alloc(&local);
+	if (h == NULL)
+		return -1;
+	operator_unwatch(g_operator.epoll, hshk->socket);
+	h->type   = type;
+	h->socket = hshk->socket;
+	memcpy(&h->creds, &hshk->creds, sizeof(h->creds));
+	h->expires = hshk->timer.expires;
+	h->pushfd  = pushfd;
+	h->join    = hshk->join;
+	name_copy(h->name, name);
+
+	/* release acceptor handshake, counts now belong to the worker */
+	handshake_release(&g_operator.dead, hshk);
+	handoff_post(h);
+	return 0;
+}
+
+
+/* take everything out of the inbox */
+static void operator_update_inbox(struct opworker *w)
+{
+	struct handoff *h;
+	eventfd_t val;
+
+	if (eventfd_read(w->inboxfd, &val) && errno != EAGAIN)
+		printf("inbox eventfd: %s\n", strerror(errno));
+
+	pthread_mutex_lock(&w->lock);
+	h = w->inbox;
+	w->inbox = NULL;
+	w->inbox_tail = NULL;
+	pthread_mutex_unlock(&w->lock);
+
+	while (h)
+	{
+		struct handoff *next = h->next;
+		operator_worker_handoff(w, h);
+		slab_free(&g_operator.handoff_pool, h);
+		h = next;
+	}
+}
+
+
+/*
+ *  listen for new connections on registration socket.
+ *  create a new host registration handshake
+ */
+static int reg_handshake_create(int sock)
+{
+	struct handshake *pending;
+	struct ucred creds;
+	socklen_t len = sizeof(struct ucred);
+
+	/* peercred gets credentials at time of connect call */
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &creds, &len)){
+		printf("getsockopt: %s\n", strerror(errno));
+		eslib_sock_axe(sock);
+		return -1;
+	}
+
+	/* bottleneck registration attempts per uid */
+	if (operator_uid_count(creds.uid, UIDCOUNT_REGISTR) >= MAXREGPERUSER) {
+		eslib_sock_axe(sock);
+		return -1;
+	}
+
+	/*
+	 * nonroot uid is limited
+	 * TODO read limits from operator config file
+	 */
+	if (creds.uid != 0) {
+		if (operator_uid_count(creds.uid, UIDCOUNT_HOSTS)
+				>= MAXHOSTSPERUSER) {
+			printf("uid(%d) at host limit\n", creds.uid);
+			eslib_sock_axe(sock);
+			return -1;
+		}
+	}
+	if (operator_count_take(&g_operator.numregistr,
+				g_operator.maxregistr)) {
+		eslib_sock_axe(sock);
+		return -1;
+	}
+	pending = slab_alloc(&g_operator.registr_pool);
+	if (pending == NULL) {
+		__sync_sub_and_fetch(&g_operator.numregistr, 1);
+		eslib_sock_axe(sock);
+		return -1;
+	}
+
+	/* create pending registration */
+	pending->pool   = &g_operator.registr_pool;
+	pending->evtype = OPEV_REGISTR_HSHK;
+	pending->socket = sock;
+	memcpy(&pending->creds, &creds, sizeof(creds));
+	if (operator_uid_inc(creds.uid, UIDCOUNT_REGISTR)
+			|| operator_watch(g_operator.epoll, sock, pending)) {
+		operator_uid_dec(creds.uid, UIDCOUNT_REGISTR);
+		__sync_sub_and_fetch(&g_operator.numregistr, 1);
+		eslib_sock_axe(sock);
+		slab_free(&g_operator.registr_pool, pending);
+		return -1;
+	}
+	pending->active = 1;
+	timewheel_add(&g_operator.timers, &pending->timer,
+		      operator_clock() + OP_REG_TIMEOUT, pending);
+	return 0;
+}
+
+static int operator_update_regconnect()
+{
+	int i;
+	int sock;
+
+	/* check for new connections to be handled next frame */
+	for (i = 0; i < MAXACCEPT; ++i)
+	{
+		sock = operator_accept_connection(g_operator.registration);
+		if (sock == -1)
+			break;
+		/* connection has been established */
+		if (reg_handshake_create(sock))
+			continue;
+	}
+	return 0;
+}
+
+
+/* find host by name, NULL if it's free or an alias */
+static struct _ophost *host_lookup(struct opworker *w, char *name)
+{
+	struct _ophost *host = nametable_lookup(&w->names, name);
+	if (host == NULL || host->evtype != OPEV_HOST)
+		return NULL;
+	return host;
+}
+
+static struct opalias *alias_lookup(struct opworker *w, char *name)
+{
+	struct opalias *alias = nametable_lookup(&w->names, name);
+	if (alias == NULL || alias->evtype != OPEV_ALIAS)
+		return NULL;
+	return alias;
+}
+
+
+/* close pending registration and release it */
+static void registration_drop(struct handshake *pending)
+{
+	if (!pending->active)
+		return;
+	operator_uid_dec(pending->creds.uid, UIDCOUNT_REGISTR);
+	__sync_sub_and_fetch(&g_operator.numregistr, 1);
+	operator_unwatch(g_operator.epoll, pending->socket);
+	eslib_sock_axe(pending->socket);
+	handshake_release(&g_operator.dead, pending);
+}
+
+
+/* register protocol:
+ *
+ * pending host sends registration message:
+ * 	the desired host name(null terminated string)
+ *
+ * server acks by sending the relay socket for new connections and
+ * hangs up, everything after that is on the relay (opproto.h).
+ * new host is added to the front of list.
+ *
+ * the new host will not be sent connection requests until it
+ * has sent operator at least one OPMSG_PING.
+ */
+static int operator_update_registration(struct handshake *pending)
+{
+	char msg[OPHOST_MAXNAME + sizeof(OPREG_REPLICA)];
+	int retval;
+	int len;
+
+	if (!pending->active)
+		return 0;
+
+	if (operator_count(&g_operator.numhosts) >= g_operator.maxhosts) {
+		printf("host limit reached, dropping registration\n");
+		goto drop_pending;
+	}
+
+	/* receive host name */
+	retval = recv(pending->socket, msg, sizeof(msg), MSG_DONTWAIT);
+	if (retval == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return 0; /* no data to recv */
+	}
+	else if (retval == 0 || retval == -1) {
+		printf("socket error\n");
+		goto drop_pending;
+	}
+
+	/* validate hostname, replicas send OPREG_REPLICA after it */
+	len = strnlen(msg, retval) + 1;
+	if (retval <= 1 || msg[0] == '\0' || len > retval
+			|| (retval != len
+			    && (retval - len != sizeof(OPREG_REPLICA)
+				|| memcmp(&msg[len], OPREG_REPLICA,
+					  sizeof(OPREG_REPLICA))))) {
+		static time_t t = 0;
+		eslib_logerror_t("operator", "erroneous hostname", &t, 10);
+		goto drop_pending;
+	}
+	if (len > OPHOST_MAXNAME)
+		goto drop_pending;
+	pending->join = (retval != len);
+
+	if (operator_handoff(pending, OPEV_REGISTR_HSHK, msg, -1) == 0)
+		return 0;
+
+drop_pending:
+	registration_drop(pending);
+	return -1;
+}
+
+
+static void host_link_tail(struct opworker *w, struct _ophost *host)
+{
+	host->next = NULL;
+	host->prev = w->hosts_tail;
+	if (w->hosts_tail)
+		w->hosts_tail->next = host;
+	else
+		w->hosts = host;
+	w->hosts_tail = host;
+}
+
+static void host_unlink(struct opworker *w, struct _ophost *host)
+{
+	if (host->prev)
+		host->prev->next = host->next;
+	else
+		w->hosts = host->next;
+	if (host->next)
+		host->next->prev = host->prev;
+	else
+		w->hosts_tail = host->prev;
+}
+
+
+/* index host by name, or add it to the ring of replicas at head */
+static int host_index(struct opworker *w, struct _ophost *host,
+		      struct _ophost *head)
+{
+	host->rnext   = host;
+	host->rprev   = host;
+	host->rcursor = host;
+	if (head == NULL)
+		return nametable_insert(&w->names, host->name, host);
+	host->rnext = head;
+	host->rprev = head->rprev;
+	head->rprev->rnext = host;
+	head->rprev = host;
+	return 0;
+}
+
+/* the next replica takes over the name if host was indexed */
+static void host_unindex(struct opworker *w, struct _ophost *host)
+{
+	struct _ophost *head = host_lookup(w, host->name);
+	struct _ophost *next = host->rnext;
+
+	if (head == NULL) {
+		eslib_logcritical("operator", "host name not indexed");
+		return;
+	}
+	host->rprev->rnext = next;
+	next->rprev = host->rprev;
+	host->rnext = host;
+	host->rprev = host;
+	if (head != host) {
+		if (head->rcursor == host)
+			head->rcursor = next;
+		return;
+	}
+	nametable_remove(&w->names, host->name);
+	if (next == host)
+		return;
+	next->rcursor = (host->rcursor == host) ? next : host->rcursor;
+	if (nametable_insert(&w->names, next->name, next))
+		eslib_logcritical("operator", "replica not indexed");
+}
+
+static unsigned int host_replicas(struct _ophost *head)
+{
+	struct _ophost *host = head;
+	unsigned int count = 0;
+	do {
+		++count;
+		host = host->rnext;
+	} while (host != head);
+	return count;
+}
+
+/*
+ * spread callers over replicas, the one with fewest requests waiting wins
+ * and ties go round robin. unconfirmed and busy replicas are passed over.
+ */
+static struct _ophost *host_pick(struct _ophost *head)
+{
+	struct _ophost *best = NULL;
+	struct _ophost *host = head->rcursor;
+
+	do {
+		if (host->confirmed && !host->busy && (best == NULL
+				|| host->numwaiting < best->numwaiting)) {
+			best = host;
+			if (best->numwaiting == 0)
+				break;
+		}
+		host = host->rnext;
+	} while (host != head->rcursor);
+	if (best == NULL)
+		return head;
+	head->rcursor = best->rnext;
+	return best;
+}
+
+/* replica an alias was added by */
+static struct _ophost *host_member(struct _ophost *head, unsigned int serial)
+{
+	struct _ophost *host = head;
+	do {
+		if (host->serial == serial)
+			return host;
+		host = host->rnext;
+	} while (host != head);
+	return NULL;
+}
+
+/* worker side of registration, name is validated by acceptor */
+static int worker_register(struct opworker *w, struct handoff *h)
+{
+	struct _ophost *host;
+	struct _ophost *head = NULL;
+	int relay[2]; /* AF_UNIX socket pair */
+
+	if (operator_count_take(&g_operator.numhosts, g_operator.maxhosts)) {
+		printf("host limit reached, dropping registration\n");
+		goto drop_pending;
+	}
+
+	/* find host, replicas of the same user can share a name */
+	if (nametable_lookup(&w->names, h->name)) {
+		head = host_lookup(w, h->name);
+		if (!h->join || head == NULL || !head->replica
+				|| head->uid != h->creds.uid
+				|| host_replicas(head) >= MAXREPLICAS)
+			goto drop_host; /* host name or alias in use */
+	}
+
+	/* name is available */
+	host = slab_alloc(&w->host_pool);
+	if (host == NULL)
+		goto drop_host;
+
+	host->evtype  = OPEV_HOST;
+	host->serial  = __sync_add_and_fetch(&g_operator.nextserial, 1);
+	host->replica = h->join;
+	name_copy(host->name, h->name);
+	if (host_index(w, host, head)) {
+		slab_free(&w->host_pool, host);
+		goto drop_host;
+	}
+
+	/* ack: create and send relay socket, keeps message boundaries */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, relay))
+		goto free_and_drop;
+
+	if (eslib_sock_send_fd(h->socket, relay[1])) {
+		printf("error sending relay fd\n");
+		close(relay[0]);
+		close(relay[1]);
+		goto free_and_drop;
+	}
+	close(relay[1]); /* don't need this half */
+
+	if (eslib_sock_setnonblock(relay[0])
+			|| operator_watch(w->epoll, relay[0], host)) {
+		close(relay[0]);
+		goto free_and_drop;
+	}
+	/* relay is all we need, host already has its end */
+	eslib_sock_axe(h->socket);
+
+	/* host has until timeout to send it's first ping */
+	if (g_operator.host_timeout) {
+		timewheel_add(&w->timers, &host->timer,
+			      operator_clock() + g_operator.host_timeout, host);
+	}
+	host->relay = relay[0];
+	host->uid = h->creds.uid;
+	operator_uid_move(host->uid, UIDCOUNT_REGISTR, UIDCOUNT_HOSTS);
+	host_link_tail(w, host);
+	__sync_sub_and_fetch(&g_operator.numregistr, 1);
+	return 0;
+
+free_and_drop:
+	host_unindex(w, host);
+	slab_free(&w->host_pool, host);
+drop_host:
+	__sync_sub_and_fetch(&g_operator.numhosts, 1);
+drop_pending:
+	operator_uid_dec(h->creds.uid, UIDCOUNT_REGISTR);
+	__sync_sub_and_fetch(&g_operator.numregistr, 1);
+	eslib_sock_axe(h->socket);
+	return -1;
+}
+
+
+
+
+static void waiting_unlink(struct _ophost *host, struct handshake *hshk)
+{
+	if (hshk->prev)
+		hshk->prev->next = hshk->next;
+	else
+		host->waiting = hshk->next;
+	if (hshk->next)
+		hshk->next->prev = hshk->prev;
+	else
+		host->waiting_tail = hshk->prev;
+	if (host->unsent == hshk)
+		host->unsent = hshk->next;
+	hshk->host = NULL;
+	--host->numwaiting;
+}
+
+/*
+ * take the request waiting on id out of hosts queue,
+ * NULL if it's gone (caller hung up or timed out).
+ */
+static struct handshake *waiting_take(struct _ophost *host, unsigned int id)
+{
+	struct handshake *hshk;
+
+	for (hshk = host->waiting; hshk; hshk = hshk->next) {
+		if (hshk->reqid == id) {
+			waiting_unlink(host, hshk);
+			return hshk;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * close caller and release request,
+ * removing it from the hosts waiting queue if needed.
+ * w is the worker holding the request, NULL if it's still in acceptor.
+ */
+static void request_drop(struct opworker *w, struct handshake *hshk)
+{
+	struct _ophost *host = hshk->host;
+
+	if (!hshk->active)
+		return;
+	operator_uid_dec(hshk->creds.uid, UIDCOUNT_REQUEST);
+	__sync_sub_and_fetch(&g_operator.numrequests, 1);
+	if (host)
+		waiting_unlink(host, hshk);
+	if (hshk->session) {
+		/* only workers hold session requests, socket isn't ours */
+		if (!hshk->replied)
+			caller_reply(hshk->socket, hshk->session, hshk->seq,
+				     -1, hshk->error);
+		session_put(hshk->session);
+		handshake_release(&w->dead, hshk);
+		return;
+	}
+	if (hshk->error && !hshk->replied) /* why, in place of an fd */
+		caller_reply(hshk->socket, NULL, 0, -1, hshk->error);
+	if (w) {
+		operator_unwatch(w->epoll, hshk->socket);
+		eslib_sock_axe(hshk->socket);
+		handshake_release(&w->dead, hshk);
+	}
+	else {
+		operator_unwatch(g_operator.epoll, hshk->socket);
+		eslib_sock_axe(hshk->socket);
+		handshake_release(&g_operator.dead, hshk);
+	}
+}
+
+
+/*
+ * host gets whatever a caller pushes, so make sure it's a stream socket
+ * the caller made itself. a socketpair carries its creator's credentials.
+ */
+static int pushfd_check(struct handshake *hshk, int fd)
+{
+	struct ucred creds;
+	socklen_t len;
+	int val;
+
+	len = sizeof(val);
+	if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &val, &len) || val != AF_UNIX)
+		return -1;
+	len = sizeof(val);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &val, &len)
+			|| val != SOCK_STREAM)
+		return -1;
+	len = sizeof(creds);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &creds, &len))
+		return -1;
+	if (creds.uid != hshk->creds.uid) {
+		printf("uid %u pushed a connection from uid %u, not its own\n",
+		       hshk->creds.uid, creds.uid);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * caller<--><operator><-->host request handshake.
+ * relays AF_UNIX connection fd from host back to caller.
+ *
+ * connection request protocol:
+ *	wait for caller to send hostname
+ *	queue a numbered connection request for host (worker_request)
+ *	send host all queued requests at once (host_flush_requests)
+ *	receive new connection fds and numbers from host (operator_update_relay)
+ *	relay each new connection fd back to the caller with that number
+ *
+ * or if caller sent a connection along with the hostname, pass it straight
+ * to host (host_deliver) and we're done.
+ *
+ * host and caller can do their own mystical handshake if they
+ * are so inclined. operator only cares about introducing them.
+ */
+static int operator_update_request(struct handshake *hshk)
+{
+	char msg[OPHOST_MAXNAME];
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		size_t align; /* as cmsghdr */
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	int pushfd = -1;
+	int retval;
+
+	if (!hshk->active)
+		return 0;
+
+	/*
+	 * get hostname, and the connection if caller made it's own
+	 * make sure we received more than a null terminator & 0 is disconnect
+	 */
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base	  = msg;
+	iov.iov_len	  = sizeof(msg);
+	mh.msg_iov	  = &iov;
+	mh.msg_iovlen	  = 1;
+	mh.msg_control	  = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+	retval = recvmsg(hshk->socket, &mh, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+	if (retval == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (retval > 0) {
+		cmsg = CMSG_FIRSTHDR(&mh);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+				&& cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&pushfd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	if (retval <= 1) {
 		printf("handshake recv(%d): %s\n", retval, strerror(errno));
 		goto eject;
 	}
-	/* validate string */
-	if (msg[0] == '\0' || msg[retval-1] != '\0') {
-		static time_t t = 0;
-		eslib_logerror_t("operator","invalid handshake message",&t,10);
-		goto eject;
+	if (retval >= (int)sizeof(OPSESS_OPEN) && pushfd == -1
+			&& !memcmp(msg, OPSESS_OPEN, sizeof(OPSESS_OPEN))) {
+		if (session_create(hshk, msg + sizeof(OPSESS_OPEN),
+				   retval - sizeof(OPSESS_OPEN)) == 0)
+			return 0;
+		goto eject;
+	}
+	/* validate string */
+	if (msg[0] == '\0' || msg[retval-1] != '\0'
+			|| mh.msg_flags & MSG_CTRUNC) {
+		static time_t t = 0;
+		eslib_logerror_t("operator","invalid handshake message",&t,10);
+		goto eject;
+	}
+	if (pushfd != -1 && pushfd_check(hshk, pushfd))
+		goto eject;
+
+	if (operator_handoff(hshk, OPEV_REQUEST_HSHK, msg, pushfd) == 0)
+		return 0;
+eject:
+	if (pushfd != -1)
+		close(pushfd);
+	request_drop(NULL, hshk);
+	return -1;
+}
+
+
+/*
+ * each request gets it's own count and deadline, like a caller that
+ * connected just for it, and is handed to the worker that owns name.
+ * anything acceptor can't pass on is answered here.
+ */
+static void session_request(struct session *s, struct opsess_req *req)
+{
+	struct handoff local;
+	struct handoff *h;
+	uid_t uid = s->creds.uid;
+	unsigned int seq = s->seq++;
+	int status = EBUSY;
+
+	if (req->name[0] == '\0'
+			|| !memchr(req->name, '\0', sizeof(req->name))) {
+		status = EINVAL;
+		goto fail;
+	}
+	if (operator_count_take(&g_operator.numrequests,
+				g_operator.maxrequests))
+		goto fail;
+	if (operator_uid_count(uid, UIDCOUNT_REQUEST) >= MAXREQPERUSER) {
+		status = EDQUOT;
+		goto drop;
+	}
+	if (operator_uid_inc(uid, UIDCOUNT_REQUEST))
+		goto drop;
+	h = handoff_alloc(&local);
+	if (h == NULL) {
+		operator_uid_dec(uid, UIDCOUNT_REQUEST);
+		status = ENOMEM;
+		goto drop;
+	}
+	__sync_add_and_fetch(&s->refs, 1);
+	h->type    = OPEV_REQUEST_HSHK;
+	h->socket  = s->socket;
+	memcpy(&h->creds, &s->creds, sizeof(h->creds));
+	h->expires = operator_clock() + OP_REQ_TIMEOUT;
+	h->pushfd  = -1;
+	h->session = s;
+	h->seq	   = seq;
+	name_copy(h->name, req->name);
+	handoff_post(h);
+	return;
+drop:
+	__sync_sub_and_fetch(&g_operator.numrequests, 1);
+fail:
+	caller_reply(s->socket, s, seq, -1, status);
+}
+
+/* acceptor lets go, requests still in flight keep the socket open */
+static void session_close(struct session *s)
+{
+	/* workers check evtype before asking for EPOLLOUT */
+	pthread_mutex_lock(&s->lock);
+	operator_unwatch(g_operator.epoll, s->socket);
+	s->evtype = OPEV_NONE;
+	pthread_mutex_unlock(&s->lock);
+	session_put(s);
+}
+
+/*
+ * read whatever requests caller has sent, one buffer per wakeup so a busy
+ * session can't hold up the acceptor. partial requests wait for the rest.
+ * queued replies go out when there is room.
+ */
+static void operator_update_session(struct session *s, unsigned int events)
+{
+	unsigned int off = 0;
+	int r;
+
+	if (s->evtype == OPEV_NONE)
+		return;
+	if (events & EPOLLOUT) {
+		pthread_mutex_lock(&s->lock);
+		session_flush(s);
+		pthread_mutex_unlock(&s->lock);
+	}
+	if (!(events & ~EPOLLOUT))
+		return;
+	r = recv(s->socket, s->buf + s->buflen, sizeof(s->buf) - s->buflen,
+		 MSG_DONTWAIT);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (r <= 0) {
+		session_close(s);
+		return;
+	}
+	s->buflen += r;
+	for (; s->buflen - off >= sizeof(struct opsess_req);
+			off += sizeof(struct opsess_req))
+		session_request(s, (struct opsess_req *)&s->buf[off]);
+	memmove(s->buf, &s->buf[off], s->buflen - off);
+	s->buflen -= off;
+}
+
+/*
+ * caller sent OPSESS_OPEN, request handshake becomes a session. data
+ * is whatever came in after it, the first requests.
+ */
+static int session_create(struct handshake *hshk, char *data,
+			  unsigned int len)
+{
+	struct session *s;
+	uid_t uid = hshk->creds.uid;
+
+	if (operator_uid_count(uid, UIDCOUNT_SESSION) >= MAXSESSPERUSER)
+		return -1;
+	if (operator_count_take(&g_operator.numsessions,
+				g_operator.maxsessions))
+		return -1;
+	s = slab_alloc(&g_operator.session_pool);
+	if (s == NULL)
+		goto drop;
+	if (pthread_mutex_init(&s->lock, NULL)) {
+		slab_free(&g_operator.session_pool, s);
+		goto drop;
+	}
+	s->evtype = OPEV_SESSION;
+	s->socket = hshk->socket;
+	s->refs   = 1;
+	memcpy(&s->creds, &hshk->creds, sizeof(s->creds));
+	if (operator_rewatch(g_operator.epoll, s->socket, s)) {
+		pthread_mutex_destroy(&s->lock);
+		slab_free(&g_operator.session_pool, s);
+		goto drop;
+	}
+	memcpy(s->buf, data, len);
+	s->buflen = len;
+
+	/* request handshake counts move to the session */
+	operator_uid_move(uid, UIDCOUNT_REQUEST, UIDCOUNT_SESSION);
+	__sync_sub_and_fetch(&g_operator.numrequests, 1);
+	handshake_release(&g_operator.dead, hshk);
+
+	operator_update_session(s, EPOLLIN);
+	return 0;
+drop:
+	__sync_sub_and_fetch(&g_operator.numsessions, 1);
+	return -1;
+}
+
+
+/* host has something to send at the end of this wakeup */
+static void host_mark_flush(struct opworker *w, struct _ophost *host)
+{
+	if (host->flushing)
+		return;
+	host->flushing  = 1;
+	host->flushnext = w->flush;
+	w->flush = host;
+}
+
+/* put deposited connections in hosts stock, what doesn't fit is closed */
+static void host_deposit(struct opworker *w, struct _ophost *host,
+			 int *fds, unsigned int count)
+{
+	unsigned int i;
+
+	if (host->restocking > count)
+		host->restocking -= count;
+	else
+		host->restocking = 0;
+	for (i = 0; i < count; ++i) {
+		if (host->numstock < host->stocktarget
+				&& !operator_count_take(&g_operator.numstocked,
+						g_operator.maxstocked)) {
+			host->stock[host->numstock++] = fds[i];
+		}
+		else {
+			close(fds[i]);
+		}
+	}
+	host_mark_flush(w, host);
+}
+
+/* host is alive, push eviction back */
+static void host_ping(struct opworker *w, struct _ophost *host)
+{
+	host->confirmed = 1;
+	if (g_operator.host_timeout) {
+		timewheel_cancel(&host->timer);
+		timewheel_add(&w->timers, &host->timer,
+			      operator_clock() + g_operator.host_timeout, host);
+	}
+}
+
+/*
+ * host is full, refuse what we haven't sent it yet. requests it already
+ * has stay until it connects them or they time out.
+ */
+static void host_busy(struct opworker *w, struct _ophost *host, int busy)
+{
+	host->busy = busy;
+	while (busy && host->unsent)
+	{
+		host->unsent->error = EBUSY;
+		request_drop(w, host->unsent);
+	}
+}
+
+/* where hosts published path is linked, 0 if name can't be a file */
+static int host_direct_link(struct _ophost *host, char *buf, unsigned int size)
+{
+	if (strchr(host->name, '/') || host->name[0] == '.')
+		return 0;
+	if (snprintf(buf, size, "%s/%s", OP_DIRECT_DIR, host->name)
+			>= (int)size)
+		return 0;
+	return 1;
+}
+
+/*
+ * point callers at the path host is listening on. operator may not see
+ * the same filesystem as host, at least make sure what we link to is a
+ * socket that belongs to host.
+ */
+static void host_publish(struct _ophost *host, char *path, unsigned int len)
+{
+	char link[OPMSG_MAXPATH];
+	struct stat st;
+
+	if (len < 2 || len > OPMSG_MAXPATH || path[len-1] != '\0'
+			|| path[0] != '/' || host->published)
+		return;
+	if (host->replica) { /* callers have to go through host_pick */
+		printf("replica %s can't publish\n", host->name);
+		return;
+	}
+	if (lstat(path, &st) || !S_ISSOCK(st.st_mode)
+			|| st.st_uid != host->uid) {
+		printf("host %s can't publish %s\n", host->name, path);
+		return;
+	}
+	if (!host_direct_link(host, link, sizeof(link)))
+		return;
+	unlink(link);
+	if (symlink(path, link)) {
+		printf("symlink %s: %s\n", link, strerror(errno));
+		return;
+	}
+	host->published = 1;
+}
+
+static void host_unpublish(struct _ophost *host)
+{
+	char link[OPMSG_MAXPATH];
+
+	if (host->published && host_direct_link(host, link, sizeof(link)))
+		unlink(link);
+	host->published = 0;
+}
+
+/* close stocked connections past count */
+static void host_trim_stock(struct _ophost *host, unsigned int count)
+{
+	while (host->numstock > count)
+	{
+		close(host->stock[--host->numstock]);
+		__sync_sub_and_fetch(&g_operator.numstocked, 1);
+	}
+}
+
+/* tell the worker that owns hosts name for tag to add or remove it */
+static void host_post_alias(struct _ophost *host, unsigned int tag, int remove)
+{
+	struct handoff local;
+	struct handoff *h;
+
+	h = handoff_alloc(&local);
+	if (h == NULL) {
+		printf("alias %s: out of memory\n", host->names[tag]);
+		return;
+	}
+	h->type   = OPEV_ALIAS;
+	h->pushfd = -1;
+	h->tag	  = tag;
+	h->serial = host->serial;
+	h->remove = remove;
+	name_copy(h->name, host->names[tag]);
+	name_copy(h->host, host->name);
+	handoff_post(h);
+}
+
+/*
+ * host serves name as tag from now on, an empty name takes tag away.
+ * each name counts as a host against its uid's limit.
+ */
+static void host_name(struct _ophost *host, unsigned int tag,
+		      char *name, unsigned int len)
+{
+	unsigned int max = host->uid ? MAXHOSTSPERUSER : (unsigned int)-1;
+
+	if (tag == 0 || tag >= OPMSG_MAXTAGS)
+		return;
+	if (host->names == NULL) {
+		host->names = calloc(OPMSG_MAXTAGS, OPHOST_MAXNAME);
+		if (host->names == NULL)
+			return;
+	}
+	if (host->names[tag][0]) {
+		host_post_alias(host, tag, 1);
+		host->names[tag][0] = '\0';
+		operator_uid_dec(host->uid, UIDCOUNT_HOSTS);
+	}
+	if (len < 2 || len > OPHOST_MAXNAME || strnlen(name, len) != len - 1)
+		return;
+	if (operator_uid_take(host->uid, UIDCOUNT_HOSTS, max)) {
+		printf("uid(%d) at host limit, %s not added\n",
+				host->uid, name);
+		return;
+	}
+	memcpy(host->names[tag], name, len);
+	host_post_alias(host, tag, 0);
+}
+
+static void host_unname_all(struct _ophost *host)
+{
+	unsigned int tag;
+
+	if (host->names == NULL)
+		return;
+	for (tag = 1; tag < OPMSG_MAXTAGS; ++tag) {
+		if (host->names[tag][0]) {
+			host_post_alias(host, tag, 1);
+			operator_uid_dec(host->uid, UIDCOUNT_HOSTS);
+		}
+	}
+	free(host->names);
+	host->names = NULL;
+}
+
+/* an alias in this workers shard was added or removed by it's host */
+static void worker_alias(struct opworker *w, struct handoff *h)
+{
+	struct opalias *alias = alias_lookup(w, h->name);
+
+	if (h->remove) {
+		/* may have been replaced since */
+		if (alias == NULL || alias->serial != h->serial
+				|| alias->tag != h->tag)
+			return;
+		nametable_remove(&w->names, alias->name);
+		slab_free(&w->alias_pool, alias);
+		return;
+	}
+	if (nametable_lookup(&w->names, h->name)) {
+		printf("alias \"%s\" for %s is taken\n", h->name, h->host);
+		return;
+	}
+	alias = slab_alloc(&w->alias_pool);
+	if (alias == NULL)
+		return;
+	alias->evtype = OPEV_ALIAS;
+	alias->serial = h->serial;
+	alias->tag    = h->tag;
+	name_copy(alias->name, h->name);
+	name_copy(alias->host, h->host);
+	if (nametable_insert(&w->names, alias->name, alias))
+		slab_free(&w->alias_pool, alias);
+}
+
+/* pass request on to the worker that owns aliased host, counts go along */
+static int request_forward(struct handoff *h, struct opalias *alias)
+{
+	struct handoff local;
+	struct handoff *fwd;
+
+	fwd = handoff_alloc(&local);
+	if (fwd == NULL)
+		return -1;
+	memcpy(fwd, h, sizeof(*fwd));
+	fwd->next   = NULL;
+	fwd->tag    = alias->tag;
+	fwd->serial = alias->serial;
+	memset(fwd->name, 0, sizeof(fwd->name));
+	name_copy(fwd->name, alias->host);
+	handoff_post(fwd);
+	return 0;
+}
+
+/* worker side of request, find host and queue a request for it */
+static int worker_request(struct opworker *w, struct handoff *h)
+{
+	struct _ophost *host = NULL;
+	struct opalias *alias;
+	struct handshake *hshk;
+	int error = ECONNREFUSED; /* caller is told why */
+	int retval;
+	int fd;
+
+	host = host_lookup(w, h->name);
+	if (host == NULL && h->serial == 0
+			&& (alias = alias_lookup(w, h->name))) {
+		if (request_forward(h, alias) == 0)
+			return 0;
+		error = ENOMEM;
+		goto eject;
+	}
+
+	/* alias may be stale, host was replaced or dropped the name */
+	if (host && h->serial) {
+		host = host_member(host, h->serial);
+		if (host && (host->names == NULL || !host->names[h->tag][0]))
+			host = NULL;
+	}
+	else if (host) {
+		host = host_pick(host);
+	}
+
+	/* receive name from caller */
+	if (host == NULL) { /* TODO remove special characters? */
+		printf("handshake: host \"%s\" not found\n", h->name);
+		error = ENOENT;
+		goto eject;
+	}
+
+	/* make sure host has been confirmed before sending request */
+	if (!host->confirmed) {
+		printf("host not confirmed yet\n");
+		error = ENOTCONN;
+		goto eject;
+	}
+
+	/* caller made the connection, host just needs it's end. if host is
+	 * full it's closed, caller sees the hangup */
+	if (h->pushfd != -1) {
+		if (host->busy) {
+			error = EBUSY;
+			goto eject;
+		}
+		if (host_deliver(host, h->pushfd, h->tag))
+			printf("[operator] -- deliver to %s failed\n", host->name);
+		retval = 0;
+		goto release;
+	}
+
+	/* answer from stock, host refills it in the background.
+	 * stock is only for the registered name */
+	if (host->numstock && h->tag == 0) {
+		fd = host->stock[--host->numstock];
+		__sync_sub_and_fetch(&g_operator.numstocked, 1);
+		if (caller_reply(h->socket, h->session, h->seq, fd, 0))
+			printf("[operator] -- send_fd stock failed\n");
+		close(fd);
+		host_mark_flush(w, host);
+		retval = 0;
+		goto release;
+	}
+
+	/* don't make caller wait on a host that said it's full */
+	if (host->busy) {
+		error = EBUSY;
+		goto eject;
+	}
+
+	hshk = slab_alloc(&w->request_pool);
+	if (hshk == NULL) {
+		error = ENOMEM;
+		goto eject;
+	}
+
+	/* caller is watched only to notice a hangup, sessions by acceptor */
+	hshk->pool    = &w->request_pool;
+	hshk->evtype  = OPEV_REQUEST_HSHK;
+	hshk->socket  = h->socket;
+	hshk->session = h->session;
+	hshk->seq     = h->seq;
+	hshk->error   = ECONNREFUSED;
+	memcpy(&hshk->creds, &h->creds, sizeof(hshk->creds));
+	if (h->session == NULL
+			&& operator_watch(w->epoll, hshk->socket, hshk)) {
+		slab_free(&w->request_pool, hshk);
+		goto eject;
+	}
+	hshk->active = 1;
+	timewheel_add(&w->timers, &hshk->timer, h->expires, hshk);
+
+	/* wait in line for the host to send back a connection */
+	hshk->state = REQ_WAIT_HOST;
+	hshk->host  = host;
+	hshk->reqid = (host->nextid++ & OPMSG_IDMASK)
+		    | h->tag << OPMSG_TAGSHIFT;
+	hshk->next  = NULL;
+	hshk->prev  = host->waiting_tail;
+	if (host->waiting_tail)
+		host->waiting_tail->next = hshk;
+	else
+		host->waiting = hshk;
+	host->waiting_tail = hshk;
+	++host->numwaiting;
+
+	/* request for connected socket is sent at end of wakeup */
+	if (host->unsent == NULL)
+		host->unsent = hshk;
+	host_mark_flush(w, host);
+	return 0;
+
+eject:
+	retval = -1;
+	caller_reply(h->socket, h->session, h->seq, -1, error);
+release:
+	if (h->pushfd != -1)
+		close(h->pushfd);
+	operator_uid_dec(h->creds.uid, UIDCOUNT_REQUEST);
+	__sync_sub_and_fetch(&g_operator.numrequests, 1);
+	if (h->session)
+		session_put(h->session);
+	else
+		eslib_sock_axe(h->socket);
+	return retval;
+}
+
+
+/*
+ * send host every request queued since the last flush, in as few
+ * messages as possible. if host can't take them they are dropped.
+ * then ask for whatever it's stock is short.
+ */
+static void host_flush_requests(struct opworker *w, struct _ophost *host)
+{
+	struct opmsg req;
+	struct handshake *hshk;
+	unsigned int want;
+	int size;
+
+	while (host->unsent)
+	{
+		req.type  = OPMSG_REQUEST;
+		req.count = 0;
+		hshk = host->unsent;
+		for (; hshk && req.count < OPMSG_MAXFDS; hshk = hshk->next)
+			req.id[req.count++] = hshk->reqid;
+		size = OPMSG_SIZE(req.count);
+		if (send(host->relay, &req, size, MSG_DONTWAIT|MSG_NOSIGNAL)
+				== size) {
+			host->unsent = hshk;
+			continue;
+		}
+		printf("send req failed\n");
+		while (host->unsent)
+			request_drop(w, host->unsent);
+	}
+
+	want = host->numstock + host->restocking;
+	if (want >= host->stocktarget)
+		return;
+	req.type  = OPMSG_REFILL;
+	req.count = host->stocktarget - want;
+	if (send(host->relay, &req, OPMSG_SIZE(0), MSG_DONTWAIT|MSG_NOSIGNAL)
+			== (int)OPMSG_SIZE(0))
+		host->restocking += req.count;
+}
+
+static void operator_flush_requests(struct opworker *w)
+{
+	struct _ophost *host;
+	while (w->flush)
+	{
+		host = w->flush;
+		w->flush = host->flushnext;
+		host->flushing = 0;
+		if (host->evtype != OPEV_NONE) /* not removed */
+			host_flush_requests(w, host);
 	}
-	host = host_lookup(msg);
+}
 
-	/* receive name from caller */
-	if (host == NULL) { /* TODO remove special characters? */
-		printf("handshake: host \"%s\" not found\n", msg);
-		goto eject;
+
+static void operator_worker_handoff(struct opworker *w, struct handoff *h)
+{
+	if (h->type == OPEV_REGISTR_HSHK)
+		worker_register(w, h);
+	else if (h->type == OPEV_ALIAS)
+		worker_alias(w, h);
+	else
+		worker_request(w, h);
+}
+
+
+/*
+ * caller has nothing more to say once the request is sent to host,
+ * this is either a hangup or a protocol error.
+ */
+static void operator_update_caller(struct opworker *w, struct handshake *hshk)
+{
+	request_drop(w, hshk);
+}
+
+
+/* a message from host, carrying up to OPMSG_MAXFDS connections */
+struct relaymsg
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct opmsg frame;
+	int res; /* recvmsg result */
+	union {
+		size_t align; /* as cmsghdr */
+		char buf[CMSG_SPACE(OPMSG_MAXFDS * sizeof(int))];
+	} cmsg;
+};
+
+/*
+ * one fd on it's way to a caller, as eslib_sock_send_fd sends it.
+ * or a session reply, with an fd if status is 0.
+ */
+struct relayslot
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char byte;
+	struct opsess_reply reply;
+	int res; /* completion result */
+	union {
+		size_t align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+};
+
+static void relaymsg_init(struct relaymsg *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->iov.iov_base	      = &m->frame;
+	m->iov.iov_len	      = sizeof(m->frame);
+	m->msg.msg_iov	      = &m->iov;
+	m->msg.msg_iovlen     = 1;
+	m->msg.msg_control    = m->cmsg.buf;
+	m->msg.msg_controllen = sizeof(m->cmsg.buf);
+}
+
+static void relayslot_init(struct relayslot *slot, int fd)
+{
+	struct cmsghdr *cmsg;
+
+	memset(slot, 0, sizeof(*slot));
+	slot->byte	       = 'F';
+	slot->iov.iov_base     = &slot->byte;
+	slot->iov.iov_len      = 1;
+	slot->msg.msg_iov      = &slot->iov;
+	slot->msg.msg_iovlen   = 1;
+	slot->msg.msg_control  = slot->cmsg.buf;
+	slot->msg.msg_controllen = sizeof(slot->cmsg.buf);
+	cmsg = CMSG_FIRSTHDR(&slot->msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len	 = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+}
+
+static void relayslot_session(struct relayslot *slot, int fd,
+			      unsigned int seq, int status)
+{
+	relayslot_init(slot, fd);
+	slot->reply.seq    = seq;
+	slot->reply.status = status;
+	slot->iov.iov_base = &slot->reply;
+	slot->iov.iov_len  = sizeof(slot->reply);
+	if (fd == -1) {
+		slot->msg.msg_control	 = NULL;
+		slot->msg.msg_controllen = 0;
 	}
+}
 
-	/* make sure host has been confirmed before sending request
-	 * any difference in times, means we have received a valid ack
-	 */
-	if (host->last_ack.tv_sec == host->time_created.tv_sec
-			&& host->last_ack.tv_usec
-			== host->time_created.tv_usec) {
-		printf("host not confirmed yet\n");
-		goto eject;
+/* pull every fd out of a received message, returns count */
+static unsigned int relaymsg_fds(struct relaymsg *m, int *fds)
+{
+	struct cmsghdr *cmsg;
+	unsigned int count = 0;
+	unsigned int n;
+
+	cmsg = CMSG_FIRSTHDR(&m->msg);
+	for (; cmsg; cmsg = CMSG_NXTHDR(&m->msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+				|| cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (count + n > OPMSG_MAXFDS)
+			n = OPMSG_MAXFDS - count; /* can't happen */
+		memcpy(&fds[count], CMSG_DATA(cmsg), n * sizeof(int));
+		count += n;
 	}
+	return count;
+}
 
-	/* send host a request for connected socket */
-	if (send(host->socket, &req, 1, 0) != 1) {
-		printf("send req failed\n");
-		goto eject;
+/*
+ * act on a received message. connections are paired with the caller
+ * waiting on their id. fds nobody is waiting on (caller went away or
+ * timed out, or bad message) are closed. returns number of pairs.
+ */
+static int relaymsg_callers(struct opworker *w, struct _ophost *host,
+			    struct relaymsg *m, struct handshake **callers,
+			    int *fds)
+{
+	struct handshake *hshk;
+	unsigned int nfds;
+	unsigned int i;
+	int count = 0;
+	int valid;
+	int size;
+
+	if (m->res <= 0)
+		return 0;
+	nfds  = relaymsg_fds(m, fds);
+	size  = OPMSG_SIZE(0);
+	if (OPMSG_HAS_IDS(m->frame.type))
+		size = OPMSG_SIZE(m->frame.count);
+	else if (m->frame.type == OPMSG_PUBLISH)
+		size = OPMSG_SIZE(0) + m->frame.count;
+	else if (m->frame.type == OPMSG_NAME && m->res > 0
+			&& m->res <= (int)OPMSG_SIZE(0) + OPHOST_MAXNAME)
+		size = m->res;
+	valid = m->res >= (int)OPMSG_SIZE(0)
+		&& m->frame.count <= OPMSG_MAXFDS
+		&& m->res == size;
+
+	if (valid && m->frame.type == OPMSG_PING)
+		host_ping(w, host);
+	if (valid && m->frame.type == OPMSG_BUSY)
+		host_busy(w, host, m->frame.count != 0);
+	if (valid && m->frame.type == OPMSG_DEPOSIT) {
+		host_deposit(w, host, fds, nfds);
+		return 0;
+	}
+	if (valid && m->frame.type == OPMSG_PUBLISH)
+		host_publish(host, (char *)m->frame.id, m->frame.count);
+	if (valid && m->frame.type == OPMSG_NAME)
+		host_name(host, m->frame.count, (char *)m->frame.id,
+			  m->res - OPMSG_SIZE(0));
+	if (valid && m->frame.type == OPMSG_STOCK) {
+		host->stocktarget = m->frame.count;
+		if (host->stocktarget > MAXSTOCK)
+			host->stocktarget = MAXSTOCK;
+		host_trim_stock(host, host->stocktarget);
+		host_mark_flush(w, host);
 	}
+	for (i = 0; i < nfds; ++i) {
+		hshk = NULL;
+		if (valid && m->frame.type == OPMSG_CONNECT
+				&& i < m->frame.count)
+			hshk = waiting_take(host, m->frame.id[i]);
+		if (hshk == NULL) {
+			close(fds[i]);
+			continue;
+		}
+		callers[count] = hshk;
+		fds[count++]   = fds[i];
+	}
+	return count;
+}
+
+/* pass a connection the caller made on to host */
+static int host_deliver(struct _ophost *host, int fd, unsigned int tag)
+{
+	struct relayslot slot;
+	struct opmsg frame;
+
+	relayslot_init(&slot, fd);
+	frame.type  = OPMSG_DELIVER;
+	frame.count = 1;
+	frame.id[0] = tag << OPMSG_TAGSHIFT;
+	slot.iov.iov_base = &frame;
+	slot.iov.iov_len  = OPMSG_SIZE(1);
+	if (sendmsg(host->relay, &slot.msg, MSG_DONTWAIT|MSG_NOSIGNAL)
+			!= (int)OPMSG_SIZE(1))
+		return -1;
+	return 0;
+}
 
+/* send what's left of one reply, fd goes with the first byte */
+static int session_send(struct session *s, struct opsess_reply *reply,
+			int fd, unsigned int sent)
+{
+	struct relayslot slot;
 
-	while (1)
+	relayslot_session(&slot, sent ? -1 : fd, reply->seq, reply->status);
+	slot.iov.iov_base = (char *)&slot.reply + sent;
+	slot.iov.iov_len  = sizeof(slot.reply) - sent;
+	return sendmsg(s->socket, &slot.msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+}
+
+/* close fds of replies that will never be sent, lock is held */
+static void session_drop_replies(struct session *s)
+{
+	for (; s->outlen; --s->outlen) {
+		if (s->outfd[s->outhead] != -1)
+			close(s->outfd[s->outhead]);
+		s->outhead = (s->outhead + 1) % SESSQUEUE;
+	}
+	s->outsent = 0;
+}
+
+/* acceptor watches for EPOLLOUT while replies are queued, lock is held */
+static void session_watch_out(struct session *s)
+{
+	struct epoll_event ev;
+	int want = (s->outlen != 0);
+
+	if (want == s->outwatch || s->evtype != OPEV_SESSION)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN|EPOLLRDHUP | (want ? EPOLLOUT : 0);
+	ev.data.ptr = s;
+	if (epoll_ctl(g_operator.epoll, EPOLL_CTL_MOD, s->socket, &ev)) {
+		printf("epoll_ctl mod: %s\n", strerror(errno));
+		return;
+	}
+	s->outwatch = want;
+}
+
+/*
+ * send queued replies until the socket is full, lock is held.
+ * on error they are dropped, acceptor will see the hangup.
+ */
+static int session_flush(struct session *s)
+{
+	unsigned int idx;
+	int r;
+
+	while (s->outlen)
 	{
-		usleep(50000);/* 50ms(ish) */
-		gettimeofday(&tmr, NULL);
-		if (eslib_ms_elapsed(tmr, hshk->timestamp,
-					    OP_REQ_TIMEOUT)) {
-			printf("registration handshake timeout\n");
-			goto eject;
+		idx = s->outhead;
+		r = session_send(s, &s->out[idx], s->outfd[idx], s->outsent);
+		if (r == -1 && (errno == EAGAIN || errno == EINTR))
+			break;
+		if (r <= 0) {
+			session_drop_replies(s);
+			session_watch_out(s);
+			return -1;
 		}
-
-		/* relay fd back to caller */
-		/* wait for host to send new AF_UNIX socket */
-		retval = eslib_sock_recv_fd(host->relay, &fd);
-		if (retval == -1 && errno == EAGAIN)
-			continue; /* back to timer check */
-		else if (retval) {
-			goto eject;
+		if (s->outfd[idx] != -1) {
+			close(s->outfd[idx]);
+			s->outfd[idx] = -1;
 		}
+		s->outsent += r;
+		if (s->outsent < sizeof(struct opsess_reply))
+			continue;
+		s->outsent = 0;
+		s->outhead = (s->outhead + 1) % SESSQUEUE;
+		--s->outlen;
+	}
+	session_watch_out(s);
+	return 0;
+}
 
-		/* relay back to caller, and we're outta here. */
-		if(eslib_sock_send_fd(hshk->socket, fd)) {
-			printf("[operator] -- send_fd hshk->socket failed\n");
-			close(fd);
-			goto eject;
+/*
+ * reply goes straight out if nothing is queued ahead of it, otherwise it
+ * waits in line with a copy of fd. a caller that lets the queue fill up
+ * isn't reading, the session is shut down and acceptor closes it.
+ */
+static int session_reply(struct session *s, unsigned int seq, int fd,
+			 int status)
+{
+	struct opsess_reply reply;
+	unsigned int idx;
+	int retval = -1;
+	int r = -1;
+
+	reply.seq    = seq;
+	reply.status = status;
+	pthread_mutex_lock(&s->lock);
+	if (s->outlen == 0) {
+		r = session_send(s, &reply, fd, 0);
+		if (r == (int)sizeof(reply)) {
+			retval = 0;
+			goto out;
 		}
-		break;
+		if (r == -1 && errno != EAGAIN && errno != EINTR)
+			goto out;
+		if (r == -1)
+			r = 0;
+	}
+	if (s->outlen >= SESSQUEUE) {
+		printf("[operator] -- session isn't reading replies\n");
+		shutdown(s->socket, SHUT_RDWR);
+		session_drop_replies(s);
+		session_watch_out(s);
+		goto out;
+	}
+
+	/* fd went with the first byte if any of it was sent */
+	if (r > 0 || fd == -1)
+		fd = -1;
+	else if ((fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1)
+		reply.status = ECONNREFUSED;
+	idx = (s->outhead + s->outlen) % SESSQUEUE;
+	memcpy(&s->out[idx], &reply, sizeof(reply));
+	s->outfd[idx] = fd;
+	if (s->outlen++ == 0)
+		s->outsent = r;
+	session_watch_out(s);
+	retval = 0;
+out:
+	pthread_mutex_unlock(&s->lock);
+	return retval;
+}
+
+/*
+ * send caller it's connection, session callers get a struct opsess_reply
+ * that may carry an error instead. fd is -1 if there is none.
+ */
+static int caller_reply(int sock, struct session *s, unsigned int seq,
+			int fd, int status)
+{
+	unsigned char byte = status;
+
+	if (s == NULL && fd == -1) {
+		/* no fd, byte says why */
+		if (send(sock, &byte, 1, MSG_DONTWAIT|MSG_NOSIGNAL) != 1)
+			return -1;
+		return 0;
+	}
+	if (s == NULL)
+		return eslib_sock_send_fd(sock, fd);
+	return session_reply(s, seq, fd, status);
+}
+
+/* submit everything queued on worker ring and wait for all of it */
+static int relay_submit(struct opworker *w, unsigned int count)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int i;
+	int *res;
+
+	if (uring_submit(&w->ring, count) == -1) {
+		/* ring is in an unknown state, stop using it */
+		printf("io_uring_enter: %s, using sendmsg\n", strerror(errno));
+		uring_destroy(&w->ring);
+		return -1;
 	}
+	for (i = 0; i < count; ++i) {
+		cqe = uring_peek(&w->ring);
+		if (cqe == NULL)
+			break;
+		res = uring_user_data(cqe);
+		if (res)
+			*res = cqe->res;
+		uring_seen(&w->ring);
+	}
+	return 0;
+}
+
+/* hand one fd to it's caller without the ring, request is done */
+static void relay_reply(struct opworker *w, struct handshake *hshk, int fd)
+{
+	if (caller_reply(hshk->socket, hshk->session, hshk->seq, fd, 0))
+		printf("[operator] -- send_fd hshk->socket failed\n");
+	hshk->replied = 1;
 	close(fd);
-	_exit(0);
+	request_drop(w, hshk);
+}
 
-eject:
-	_exit(-1);
+/*
+ * hand each fd to it's caller and close our copy, those requests are
+ * done. goes through the worker ring RELAY_BATCH at a time if there is
+ * one, the ring closes fds after sending. session replies can't, they
+ * share a stream with other threads (see session_reply).
+ */
+static void relay_deliver(struct opworker *w, struct handshake **callers,
+			  int *fds, int count)
+{
+	struct relayslot slots[RELAY_BATCH];
+	struct io_uring_sqe *sqe, *shut;
+	int i = 0;
+	int k, n;
+
+	while (i < count && w->ring.fd != -1)
+	{
+		if (callers[i]->session) {
+			relay_reply(w, callers[i], fds[i]);
+			++i;
+			continue;
+		}
+		for (k = 0; k < RELAY_BATCH && i + k < count
+				&& !callers[i + k]->session; ++k) {
+			/* sqes are zeroed, an unused one is a nop */
+			sqe  = uring_sqe(&w->ring);
+			shut = sqe ? uring_sqe(&w->ring) : NULL;
+			if (shut == NULL)
+				break;
+			relayslot_init(&slots[k], fds[i + k]);
+			uring_prep_sendmsg(sqe, callers[i + k]->socket,
+					   &slots[k].msg,
+					   MSG_DONTWAIT|MSG_NOSIGNAL,
+					   &slots[k].res);
+			sqe->flags |= IOSQE_IO_HARDLINK;
+			uring_prep_close(shut, fds[i + k], NULL);
+		}
+		if (k == 0 || relay_submit(w, w->ring.queued))
+			break;
+		for (n = 0; n < k; ++n, ++i) {
+			if (slots[n].res != (int)slots[n].iov.iov_len)
+				printf("[operator] -- send_fd hshk->socket failed\n");
+			callers[i]->replied = 1;
+			request_drop(w, callers[i]);
+		}
+	}
+
+	/* no ring, or it's full or broken */
+	for (; i < count; ++i)
+		relay_reply(w, callers[i], fds[i]);
+}
+
+/*
+ * receive with io_uring, replies for everything waiting on host are
+ * received with one submission. seqpacket FIONREAD is only the size of
+ * the first message, so the batch is sized by the waiting queue.
+ * receives past the end fail with EAGAIN.
+ * returns -1 if there was nothing to read, or the ring broke.
+ */
+static int relay_batch(struct opworker *w, struct _ophost *host)
+{
+	struct relaymsg msgs[RELAY_RECV];
+	struct handshake *callers[OPMSG_MAXFDS];
+	struct io_uring_sqe *sqe;
+	int fds[OPMSG_MAXFDS];
+	int pending;
+	int count;
+	int i;
+
+	if (ioctl(host->relay, FIONREAD, &pending) || pending <= 0)
+		return -1;
+	pending = host->numwaiting;
+	if (pending > RELAY_RECV)
+		pending = RELAY_RECV;
+	else if (pending == 0)
+		pending = 1; /* stale reply */
+
+	for (i = 0; i < pending; ++i) {
+		sqe = uring_sqe(&w->ring);
+		if (sqe == NULL)
+			break;
+		relaymsg_init(&msgs[i]);
+		uring_prep_recvmsg(sqe, host->relay, &msgs[i].msg,
+				   MSG_DONTWAIT|MSG_CMSG_CLOEXEC, &msgs[i].res);
+	}
+	if (relay_submit(w, i))
+		return -1;
+
+	for (pending = i, i = 0; i < pending; ++i) {
+		count = relaymsg_callers(w, host, &msgs[i], callers, fds);
+		relay_deliver(w, callers, fds, count);
+	}
+	return 0;
+}
+
+
+/*
+ * host has sent back new connections,
+ * relay them to waiting callers and we're done with those requests.
+ */
+static void operator_update_relay(struct opworker *w, struct _ophost *host,
+				  unsigned int events)
+{
+	struct relaymsg m;
+	struct handshake *callers[OPMSG_MAXFDS];
+	int fds[OPMSG_MAXFDS];
+	int count;
+
+	if (w->ring.fd != -1 && relay_batch(w, host) == 0)
+		goto check_hangup;
+
+	while (1)
+	{
+		/* wait for host to send new AF_UNIX sockets */
+		relaymsg_init(&m);
+		m.res = recvmsg(host->relay, &m.msg,
+				MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+		if (m.res == -1 && (errno == EAGAIN || errno == EINTR))
+			break;
+		else if (m.res <= 0) {
+			events |= EPOLLHUP;
+			break;
+		}
+
+		/* relay back to callers, and we're done. */
+		count = relaymsg_callers(w, host, &m, callers, fds);
+		relay_deliver(w, callers, fds, count);
+	}
+
+check_hangup:
+	/* relay is the only line to host */
+	if (events & OPEV_HANGUP) {
+		printf("host %s hung up\n", host->name);
+		remove_host(w, host);
+	}
 }
 
 
 /*
- * move caller over to a new thread which will complete the handshake,
+ * create a new request handshake for caller,
  * host will connect to itself, and send back that socket.
  */
 static int req_handshake_create(int caller)
 {
-	unsigned int idx;
-	pid_t pid;
+	struct handshake *hshk;
 	struct ucred creds;
 	socklen_t len = sizeof(struct ucred);
 
-	/* find free slot */
-	for (idx = 0 ; idx < MAXREQ_HSHK; ++idx) {
-		if (!g_operator.requests[idx].active)
-			break;
-	}
-	if (idx >= MAXREQ_HSHK) {
+	if (operator_count_take(&g_operator.numrequests,
+				g_operator.maxrequests)) {
+		caller_reply(caller, NULL, 0, -1, EBUSY);
 		eslib_sock_axe(caller);
-		return -1; /* no free slots */
+		return -1;
 	}
 
 	/* peercred gets credentials at time of connect call */
 	if (getsockopt(caller, SOL_SOCKET, SO_PEERCRED, &creds, &len)){
 		printf("getsockopt: %s\n", strerror(errno));
-		eslib_sock_axe(caller);
-		return -1;
+		goto drop;
 	}
 
 	/* bottleneck connection attempts per uid */
-	if (handshake_count_uid(g_operator.requests,
-				MAXREQ_HSHK, creds.uid) != 0) {
-		eslib_sock_axe(caller);
-		return -1;
+	if (operator_uid_count(creds.uid, UIDCOUNT_REQUEST) >= MAXREQPERUSER) {
+		caller_reply(caller, NULL, 0, -1, EDQUOT);
+		goto drop;
 	}
 
-	memset(&g_operator.requests[idx], 0, sizeof(struct handshake));
-	g_operator.requests[idx].active = 1;
-	g_operator.requests[idx].socket = caller;
-	gettimeofday(&g_operator.requests[idx].timestamp, NULL);
-	memcpy(&g_operator.requests[idx].creds, &creds, sizeof(creds));
-
-	pid = fork();
-	if (pid == 0) { /* enter handshake loop */
-		req_handshake_process(&g_operator.requests[idx]);
+	hshk = slab_alloc(&g_operator.request_pool);
+	if (hshk == NULL)
+		goto drop;
+	hshk->pool   = &g_operator.request_pool;
+	hshk->evtype = OPEV_REQUEST_NAME;
+	hshk->state  = REQ_WAIT_NAME;
+	hshk->socket = caller;
+	memcpy(&hshk->creds, &creds, sizeof(creds));
+	if (operator_uid_inc(creds.uid, UIDCOUNT_REQUEST)
+			|| operator_watch(g_operator.epoll, caller, hshk)) {
+		operator_uid_dec(creds.uid, UIDCOUNT_REQUEST);
+		slab_free(&g_operator.request_pool, hshk);
+		goto drop;
 	}
-	else if (pid != -1) /* save pid so we can id process when it returns */
-		g_operator.requests[idx].pid = pid;
-	else /* error, clear slot */
-		memset(&g_operator.requests[idx], 0, sizeof(struct handshake));
-
-	close(caller);
-	g_operator.requests[idx].socket = -1;
-
-	if (pid == -1)
-		return -1;
-	else
-		return 0;
+	hshk->active = 1;
+	timewheel_add(&g_operator.timers, &hshk->timer,
+		      operator_clock() + OP_REQ_TIMEOUT, hshk);
+
+	/* hostname is usually sent along with connect, don't wait for epoll */
+	return operator_update_request(hshk);
+drop:
+	__sync_sub_and_fetch(&g_operator.numrequests, 1);
+	eslib_sock_axe(caller);
+	return -1;
 }
 
 
 /*
  * requests are a remote caller trying to look up a registered host.
- * the handshake function happens in it's own thread.
- * operator will remove handshakes that idle for too long,
- * and collect pid's for successful handshakes.
+ * accept every pending caller and start their handshake.
  */
 static int operator_update_requests()
 {
-	struct timeval tmr;
-	unsigned int i, h;
+	unsigned int i;
 	int sock;
-	int status;
-	pid_t retpid;
-	pid_t wpid = -1;
-
-	gettimeofday(&tmr, NULL);
-
-	/* check handshake status */
-	for (i = 0; i < MAXREQ_HSHK; ++i)
-	{
-		if (!g_operator.requests[i].active)
-			continue;
-
-		/* check expired handshakes */
-		if (eslib_ms_elapsed(tmr, g_operator.requests[i].timestamp,
-					OP_REQ_TIMEOUT)) {
-			printf("handshake timeout pid: %d\n",
-					g_operator.requests[i].pid);
-			/* don't ever try to kill init */
-			if (g_operator.requests[i].pid > 1)
-				kill(g_operator.requests[i].pid, SIGKILL);
-			retpid = g_operator.requests[i].pid;
-			goto clear_slot;
-		}
-
-		/* collect successful handshakes */
-		retpid = waitpid(wpid, &status, WNOHANG);
-		if (retpid == 0) {
-			continue;
-		}
-		else if (retpid < 0) {
-			static time_t t = 0;
-			eslib_logerror_t("operator", "request pid error",
-					&t, 2);
-			continue;
-		}
-clear_slot:
-		/* free up the handshake slot in global array */
-		for (h = 0; h < MAXREQ_HSHK; ++h) {
-			if (g_operator.requests[h].pid == retpid) {
-				memset(&g_operator.requests[h], 0,
-						sizeof(struct handshake));
-				break;
-			}
-		} /* was not found, should never happen */
-		if (h >= MAXREQ_HSHK) {
-			snprintf(g_errbuf, sizeof(g_errbuf),
-					"handshake pid %d not found", retpid);
-			eslib_logcritical("operator", g_errbuf);
-			memset(g_operator.requests, 0,	sizeof(g_operator.requests));
-		}
-	}
 
-	/* check for new connections to be handled next frame */
 	for (i = 0; i < MAXACCEPT; ++i) {
-		sock = operator_accept_connection(g_operator.request, 0);
+		sock = operator_accept_connection(g_operator.request);
 		if (sock == -1)
 			break;
 		/* connection has been established */
@@ -663,73 +2764,162 @@ clear_slot:
 }
 
 
-/* remove current, and return prev */
-static struct _ophost *remove_host(struct _ophost *prev,
-				   struct _ophost *current)
-{
-	if (!current) {
-		eslib_logcritical("operator", "remove_host current==NULL");
-		return NULL;
-	}
-	if (prev)
-		prev->next = current->next;
-	else
-		g_operator.hosts = current->next;
-
-	eslib_sock_axe(current->socket);
-	eslib_sock_axe(current->relay);
-	free(current);
-	if (g_operator.numhosts)
-		--g_operator.numhosts;
-	if (prev)
-		return prev;
-	else
-		return g_operator.hosts;
-}
-
-
-/* check for host pings, disconnects, and TODO handle host timeout */
-static void operator_update_hosts()
+/*
+ * sockets accepted by multishot accept on either listener. if the kernel
+ * ends a multishot it is armed again, unless accept can't work this way at
+ * all, then that listener goes back to epoll.
+ */
+static void operator_update_uring()
 {
-	struct _ophost *host, *prev;
-	struct timeval tmr;
-	int retval;
-	char buf;
+	struct io_uring_cqe *cqe;
+	unsigned int more;
+	unsigned int i;
+	int *tag;
+	int listener;
+	int sock;
 
-	prev = NULL;
-	host = g_operator.hosts;
-	while (host)
+	for (i = 0; i < MAXACCEPT; ++i)
 	{
-		/* check connection status */
-		retval = recv(host->socket, &buf, 1, MSG_DONTWAIT);
-		if ((retval == -1 && (errno != EAGAIN && errno != EINTR))
-				|| retval == 0) {
-			/* disconnected */
-			printf("\n----------------------------------------\n");
-			printf("HOST REMOVED: %s\n", host->name);
-			printf("\n----------------------------------------");
-			host = remove_host(prev, host);
+		cqe = uring_peek(&g_operator.ring);
+		if (cqe == NULL)
+			break;
+		tag  = uring_user_data(cqe);
+		sock = cqe->res;
+		more = cqe->flags & IORING_CQE_F_MORE;
+		uring_seen(&g_operator.ring);
+
+		if (tag == &g_operator.ev_registration) {
+			listener = g_operator.registration;
+			if (sock >= 0)
+				reg_handshake_create(sock);
 		}
-		else if (buf == 'K') {
-			/* update last ack timestamp */
-			gettimeofday(&tmr, NULL);
-			memcpy(&host->last_ack, &tmr, sizeof(tmr));
+		else {
+			listener = g_operator.request;
+			if (sock >= 0)
+				req_handshake_create(sock);
 		}
+		if (sock < 0 && sock != -EINTR && sock != -EAGAIN)
+			printf("multishot accept: %s\n", strerror(-sock));
+		if (more)
+			continue;
 
-		/* iterate */
-		if (host) {
-			prev = host;
-			host = host->next;
+		if (sock == -EINVAL || sock == -EOPNOTSUPP
+				|| operator_arm_accept(listener, tag)) {
+			printf("multishot accept failed, using epoll\n");
+			operator_watch(g_operator.epoll, listener, tag);
 		}
 	}
+	if (g_operator.ring.queued && uring_submit(&g_operator.ring, 0) == -1)
+		printf("io_uring_enter: %s\n", strerror(errno));
+	/* a burst of callers can fill the cq, anything held back is
+	 * picked up next wakeup */
+	uring_flush(&g_operator.ring);
 }
 
 
+/*
+ * epoll timeout, sleep until the nearest deadline,
+ * or forever if there is nothing pending.
+ */
+static int operator_next_timeout(struct opworker *w, int acceptor)
+{
+	unsigned long now = operator_clock();
+	long timeout = -1;
+	long next;
+
+	if (acceptor)
+		timeout = timewheel_timeout(&g_operator.timers, now);
+	if (w) {
+		next = timewheel_timeout(&w->timers, now);
+		if (timeout == -1 || (next != -1 && next < timeout))
+			timeout = next;
+	}
+	return timeout > INT_MAX ? INT_MAX : timeout;
+}
 
 
+/* w is NULL for handshakes still in the acceptor */
+static void operator_expire(struct opworker *w, void *ptr)
+{
+	switch (*(int *)ptr)
+	{
+	case OPEV_REGISTR_HSHK:
+		printf("pending connection expired, dropping...\n");
+		registration_drop(ptr);
+		break;
+	case OPEV_REQUEST_NAME:
+	case OPEV_REQUEST_HSHK:
+		printf("request handshake timeout\n");
+		((struct handshake *)ptr)->error = ETIMEDOUT;
+		request_drop(w, ptr);
+		break;
+	case OPEV_HOST:
+		printf("host %s timed out, evicting\n",
+				((struct _ophost *)ptr)->name);
+		remove_host(w, ptr);
+		break;
+	default:
+		eslib_logcritical("operator", "unknown timer type");
+		break;
+	}
+}
 
+/* drop registrations, requests, and hosts whose deadline has passed */
+static void operator_expire_timers(struct opworker *w, int acceptor)
+{
+	unsigned long now = operator_clock();
+	struct timer *t;
 
+	if (acceptor) {
+		timewheel_advance(&g_operator.timers, now);
+		while ((t = timewheel_expired(&g_operator.timers)))
+			operator_expire(NULL, t->ptr);
+	}
+	if (w) {
+		timewheel_advance(&w->timers, now);
+		while ((t = timewheel_expired(&w->timers)))
+			operator_expire(w, t->ptr);
+	}
+}
 
 
+/*
+ * unlink host and drop it's waiting requests, memory is released after
+ * this wakeup's events have all been dispatched.
+ */
+static void remove_host(struct opworker *w, struct _ophost *host)
+{
+	if (!host) {
+		eslib_logcritical("operator", "remove_host host==NULL");
+		return;
+	}
+	host_unlink(w, host);
+	timewheel_cancel(&host->timer);
+	host_unindex(w, host);
+	operator_uid_dec(host->uid, UIDCOUNT_HOSTS);
+
+	while (host->waiting)
+		request_drop(w, host->waiting);
+	host_trim_stock(host, 0);
+	host_unpublish(host);
+	host_unname_all(host);
+
+	operator_unwatch(w->epoll, host->relay);
+	eslib_sock_axe(host->relay);
+	host->evtype = OPEV_NONE;
+	host->next = w->removed;
+	w->removed = host;
+	__sync_sub_and_fetch(&g_operator.numhosts, 1);
+}
 
 
+static void operator_free_removed(struct opworker *w)
+{
+	struct _ophost *host;
+	while (w->removed)
+	{
+		host = w->removed;
+		w->removed = host->next;
+		slab_free(&w->host_pool, host);
+	}
+}
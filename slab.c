@@ -0,0 +1,112 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <malloc.h>
+
+#include "slab.h"
+
+struct slabchunk
+{
+	struct slabchunk *next;
+	unsigned int count;
+};
+
+/* objects start after chunk header, keep them pointer aligned */
+#define slab_align(size_) (((size_) + sizeof(void *) - 1) \
+				& ~(sizeof(void *) - 1))
+#define slab_chunkhdr slab_align(sizeof(struct slabchunk))
+
+
+/* carve a new chunk of count objects onto the free list */
+static int slab_grow(struct slab *self, unsigned int count)
+{
+	struct slabchunk *chunk;
+	char *obj;
+	unsigned int i;
+
+	chunk = malloc(slab_chunkhdr + (size_t)count * self->objsize);
+	if (chunk == NULL)
+		return -1;
+	chunk->count = count;
+	chunk->next  = self->chunks;
+	self->chunks = chunk;
+
+	/* thread objects onto free list in address order */
+	obj = (char *)chunk + slab_chunkhdr;
+	for (i = 0; i < count; ++i) {
+		*(void **)(obj + (size_t)i * self->objsize) =
+			(i + 1 < count) ? obj + (size_t)(i+1) * self->objsize
+					: self->freelist;
+	}
+	self->freelist = obj;
+	self->total += count;
+	return 0;
+}
+
+
+int slab_init(struct slab *self, unsigned int objsize,
+	      unsigned int count, int locked)
+{
+	memset(self, 0, sizeof(*self));
+	if (objsize < sizeof(void *))
+		objsize = sizeof(void *);
+	self->objsize = slab_align(objsize);
+	self->locked  = locked;
+	if (locked && pthread_mutex_init(&self->lock, NULL))
+		return -1;
+	if (count < 1)
+		count = 1;
+	return slab_grow(self, count);
+}
+
+
+void slab_destroy(struct slab *self)
+{
+	struct slabchunk *chunk;
+	while (self->chunks)
+	{
+		chunk = self->chunks;
+		self->chunks = chunk->next;
+		free(chunk);
+	}
+	if (self->locked)
+		pthread_mutex_destroy(&self->lock);
+	memset(self, 0, sizeof(*self));
+}
+
+
+void *slab_alloc(struct slab *self)
+{
+	void *obj = NULL;
+
+	if (self->locked)
+		pthread_mutex_lock(&self->lock);
+	if (self->freelist == NULL && slab_grow(self, self->total))
+		goto out;
+	obj = self->freelist;
+	self->freelist = *(void **)obj;
+	++self->used;
+out:
+	if (self->locked)
+		pthread_mutex_unlock(&self->lock);
+	if (obj)
+		memset(obj, 0, self->objsize);
+	return obj;
+}
+
+
+void slab_free(struct slab *self, void *obj)
+{
+	if (obj == NULL)
+		return;
+	if (self->locked)
+		pthread_mutex_lock(&self->lock);
+	*(void **)obj = self->freelist;
+	self->freelist = obj;
+	--self->used;
+	if (self->locked)
+		pthread_mutex_unlock(&self->lock);
+}
@@ -0,0 +1,50 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ *
+ * slab
+ *
+ * fixed size object pool. objects are carved out of large chunks and
+ * recycled through a free list, alloc and free are O(1) and never call
+ * malloc unless the pool has to grow. each new chunk is as large as the
+ * whole pool so far, objects never move once allocated.
+ *
+ * pools are single threaded unless created with locked set, in which
+ * case any thread may alloc or free.
+ */
+
+#ifndef SLAB_H__
+#define SLAB_H__
+
+#include <pthread.h>
+
+struct slabchunk;
+struct slab
+{
+	void *freelist;
+	struct slabchunk *chunks;
+	unsigned int objsize;
+	unsigned int total;  /* objects carved so far */
+	unsigned int used;   /* objects handed out */
+	int locked;
+	pthread_mutex_t lock;
+};
+
+/*
+ * count objects are allocated up front, at least 1.
+ * returns
+ *  0 if ok
+ * -1 on error
+ */
+int slab_init(struct slab *self, unsigned int objsize,
+	      unsigned int count, int locked);
+void slab_destroy(struct slab *self);
+
+/*
+ * returns
+ * zeroed object
+ * NULL if out of memory
+ */
+void *slab_alloc(struct slab *self);
+void slab_free(struct slab *self, void *obj);
+
+#endif
@@ -0,0 +1,636 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ *
+ * a host of each kind operator supports (worker threads, extra names,
+ * replicas, busy) and a caller that reaches them every way it can, one
+ * connection at a time, through a session, and all at once. hosts answer
+ * with a label so the caller can tell who it got. one more host checks
+ * it's own ready ring and worker queue. needs operator running, or give
+ * the command to start one:   ./operator_hosttest ./operator -t 4
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "../lib/ophost.h"
+
+#define NUMWORKERS  2
+#define NUMREPLICAS 2
+#define NUMHOSTS    (3 + NUMREPLICAS)
+#define SESSROUNDS  4  /* times each case is queued on one session */
+#define SPREADCOUNT 32 /* connections made to replicas and workers */
+#define LABELSIZE   32
+#define RINGPATH    "/tmp/operator_hosttest_ring"
+#define RINGCOUNT   (OPHOST_WORKERQ + OPHOST_MAXHANDSHAKES) /* fills both */
+
+/* what caller asks for, and the label that answers or why it can't */
+struct testcase
+{
+	char *name;
+	char *label; /* NULL if it fails */
+	int error;
+};
+
+static struct testcase cases[] = {
+	{ "hosttest_echo",	"echo.0",  0      },
+	{ "hosttest_workers",	"workers", 0      },
+	{ "hosttest_nosuch",	NULL,	   ENOENT },
+	{ "hosttest_alias",	"echo.1",  0      },
+	{ "hosttest_replica",	"replica", 0      },
+	{ "hosttest_busy",	NULL,	   EBUSY  }
+};
+#define NUMCASES (sizeof(cases) / sizeof(cases[0]))
+
+static struct ophost *g_workhost;
+
+
+/*
+ * hosts
+ */
+
+/* caller only needs to know who answered */
+static void send_label(int caller, char *label)
+{
+	int len = strlen(label) + 1;
+
+	if (send(caller, label, len, MSG_NOSIGNAL) != len)
+		printf("[host] label send failed\n");
+	close(caller);
+}
+
+static int label_caller(struct ophost *host, int caller, unsigned int tag,
+			void *arg)
+{
+	char label[LABELSIZE];
+
+	(void)host;
+	snprintf(label, sizeof(label), "%s.%u", (char *)arg, tag);
+	send_label(caller, label);
+	return 0;
+}
+
+static struct ophost *host_start(char *name, int replica)
+{
+	struct ophost *host;
+
+	if (replica)
+		host = ophost_register_replica(name);
+	else
+		host = ophost_register(name);
+	if (host == NULL) {
+		printf("[host] %s registration failed\n", name);
+		exit(-1);
+	}
+	return host;
+}
+
+/* answers the name it registered as with tag 0, alias with tag 1 */
+static void echo_exec(unsigned int num)
+{
+	struct ophost *host = host_start("hosttest_echo", 0);
+
+	(void)num;
+	if (ophost_add_name(host, "hosttest_alias") != 1) {
+		printf("[echo] add_name failed\n");
+		exit(-1);
+	}
+	ophost_run(host, label_caller, "echo");
+	printf("[echo] run failed\n");
+	exit(-1);
+}
+
+static void *worker_thread(void *arg)
+{
+	unsigned int worker = (unsigned int)(long)arg;
+	char label[LABELSIZE];
+	struct pollfd pfd;
+	int caller;
+
+	snprintf(label, sizeof(label), "workers.%u", worker);
+	pfd.fd	   = ophost_worker_fd(g_workhost, worker);
+	pfd.events = POLLIN;
+	while (1)
+	{
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			break;
+		while ((caller = ophost_worker_take(g_workhost, worker, NULL))
+				!= -1)
+			send_label(caller, label);
+	}
+	printf("[workers] worker %u poll failed\n", worker);
+	exit(-1);
+	return NULL;
+}
+
+/* accepts on this thread, callers are answered by worker threads */
+static void workers_exec(unsigned int num)
+{
+	pthread_t thread;
+	long i;
+
+	(void)num;
+	g_workhost = host_start("hosttest_workers", 0);
+	if (ophost_set_workers(g_workhost, NUMWORKERS)) {
+		printf("[workers] set_workers failed\n");
+		exit(-1);
+	}
+	for (i = 0; i < NUMWORKERS; ++i) {
+		if (pthread_create(&thread, NULL, worker_thread, (void *)i)) {
+			printf("[workers] pthread_create failed\n");
+			exit(-1);
+		}
+	}
+	ophost_run(g_workhost, NULL, NULL);
+	printf("[workers] run failed\n");
+	exit(-1);
+}
+
+static void replica_exec(unsigned int num)
+{
+	struct ophost *host = host_start("hosttest_replica", 1);
+	char label[LABELSIZE];
+
+	snprintf(label, sizeof(label), "replica%u", num);
+	ophost_run(host, label_caller, label);
+	printf("[replica] run failed\n");
+	exit(-1);
+}
+
+/* says it's full right away, callers should never reach it */
+static void busy_exec(unsigned int num)
+{
+	struct ophost *host = host_start("hosttest_busy", 0);
+
+	(void)num;
+	if (ophost_busy(host, 1)) {
+		printf("[busy] ophost_busy failed\n");
+		exit(-1);
+	}
+	ophost_run(host, label_caller, "busy");
+	printf("[busy] run failed\n");
+	exit(-1);
+}
+
+
+/*
+ * ring host connects to it's own published path, every connection sends
+ * the order it was made in. they have to come back out in that order,
+ * through the worker queue first and then the ready ring. nothing is
+ * taken until both are full, then nothing more should get in.
+ */
+static int ring_connect(unsigned int idx)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, RINGPATH, sizeof(addr.sun_path)-1);
+	sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))
+			|| send(sock, &idx, sizeof(idx), 0) != sizeof(idx)) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* fd should be connection number idx, fd is closed */
+static int ring_expect(int fd, unsigned int idx, char *how)
+{
+	unsigned int got = 0;
+	int r;
+
+	if (fd == -1) {
+		printf("[ring] %s %u: nothing there\n", how, idx);
+		return -1;
+	}
+	r = recv(fd, &got, sizeof(got), MSG_DONTWAIT);
+	close(fd);
+	if (r != sizeof(got) || got != idx) {
+		printf("[ring] %s expected %u, got %u\n", how, idx, got);
+		return -1;
+	}
+	return 0;
+}
+
+static unsigned int ring_queued(struct ophost *host)
+{
+	return host->workers[0].tail - host->workers[0].head;
+}
+
+static int ring_check(struct ophost *host, int *callers)
+{
+	int fds[OPHOST_MAXHANDSHAKES];
+	unsigned int made = 0;
+	unsigned int idx = 0;
+	unsigned int i;
+	int count;
+
+	/* a few at a time, listen backlog is OPHOST_MAXHANDSHAKES */
+	while (made < RINGCOUNT)
+	{
+		for (i = 0; i < OPHOST_MAXACCEPT && made < RINGCOUNT; ++i) {
+			callers[made] = ring_connect(made);
+			if (callers[made++] == -1)
+				return -1;
+		}
+		if (ophost_accept(host) || ophost_distribute(host) == -1)
+			return -1;
+		if (host->num_hshks > OPHOST_READYSIZE)
+			return -1;
+	}
+	if (ring_queued(host) != OPHOST_WORKERQ
+			|| host->num_hshks != OPHOST_MAXHANDSHAKES) {
+		printf("[ring] queued %u, ready %u\n",
+		       ring_queued(host), host->num_hshks);
+		return -1;
+	}
+
+	/* both full, these wait in the listen backlog */
+	for (i = 0; i < OPHOST_MAXACCEPT; ++i) {
+		callers[made] = ring_connect(made);
+		if (callers[made++] == -1)
+			return -1;
+	}
+	if (ophost_accept(host) || ophost_distribute(host) != 0
+			|| host->num_hshks != OPHOST_MAXHANDSHAKES) {
+		printf("[ring] accepted with no room\n");
+		return -1;
+	}
+
+	/* one taken makes room for the oldest ready, and one from backlog */
+	if (ring_expect(ophost_worker_take(host, 0, NULL), idx++, "worker"))
+		return -1;
+	if (ophost_distribute(host) != 1 || ophost_accept(host)
+			|| host->num_hshks != OPHOST_MAXHANDSHAKES) {
+		printf("[ring] no room after worker took one\n");
+		return -1;
+	}
+
+	/* everything comes out in order */
+	for (i = 0; i < OPHOST_WORKERQ; ++i) {
+		if (ring_expect(ophost_worker_take(host, 0, NULL), idx++,
+				"worker"))
+			return -1;
+	}
+	if (ophost_worker_take(host, 0, NULL) != -1 || errno != EAGAIN)
+		return -1;
+	count = ophost_handshake_many(host, fds, NULL, OPHOST_MAXHANDSHAKES);
+	if (count != OPHOST_MAXHANDSHAKES)
+		return -1;
+	for (i = 0; i < (unsigned int)count; ++i) {
+		if (ring_expect(fds[i], idx++, "ready"))
+			return -1;
+	}
+	if (ophost_accept(host))
+		return -1;
+	while (idx < made)
+	{
+		if (ring_expect(ophost_handshake(host), idx++, "backlog"))
+			return -1;
+	}
+	if (ophost_handshake(host) != -1)
+		return -1;
+	return 0;
+}
+
+/* exits with the result, nobody calls it */
+static void ring_exec(unsigned int num)
+{
+	struct ophost *host = host_start("hosttest_ring", 0);
+	int callers[RINGCOUNT + OPHOST_MAXACCEPT];
+	unsigned int i;
+	int r;
+
+	(void)num;
+	for (i = 0; i < RINGCOUNT + OPHOST_MAXACCEPT; ++i)
+		callers[i] = -1;
+	if (ophost_set_workers(host, 1) || ophost_publish(host, RINGPATH)) {
+		printf("[ring] setup failed\n");
+		exit(-1);
+	}
+	r = ring_check(host, callers);
+	for (i = 0; i < RINGCOUNT + OPHOST_MAXACCEPT; ++i) {
+		if (callers[i] != -1)
+			close(callers[i]);
+	}
+	ophost_destroy(host);
+	printf("[ring] %s\n", r ? "failed" : "in order");
+	exit(r ? -1 : 0);
+}
+
+
+/*
+ * caller
+ */
+
+/* read who answered, 0 if label starts with expected */
+static int check_label(int fd, char *expected, char *label)
+{
+	struct pollfd pfd;
+	int r = 0;
+
+	memset(label, 0, LABELSIZE);
+	pfd.fd	   = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 2000) == 1)
+		r = recv(fd, label, LABELSIZE - 1, 0);
+	if (r <= 0 || strncmp(label, expected, strlen(expected))) {
+		printf("[peer] expected %s, got %s\n", expected,
+		       r > 0 ? label : "nothing");
+		return -1;
+	}
+	return 0;
+}
+
+/* fd or error is what cases[i] should get, fd is closed */
+static int check_case(unsigned int i, int fd, int error, char *how)
+{
+	char label[LABELSIZE];
+	int retval = 0;
+
+	if (cases[i].label == NULL) {
+		if (fd != -1 || error != cases[i].error) {
+			printf("[peer] %s %s: expected %s, got %s\n",
+			       how, cases[i].name, strerror(cases[i].error),
+			       fd != -1 ? "a connection" : strerror(error));
+			retval = -1;
+		}
+	}
+	else if (fd == -1) {
+		printf("[peer] %s %s failed: %s\n",
+		       how, cases[i].name, strerror(error));
+		retval = -1;
+	}
+	else if (check_label(fd, cases[i].label, label)) {
+		printf("[peer] %s %s answered by the wrong host\n",
+		       how, cases[i].name);
+		retval = -1;
+	}
+	if (fd != -1)
+		close(fd);
+	return retval;
+}
+
+static int test_connect()
+{
+	unsigned int i;
+	int err = 0;
+	int fd;
+
+	for (i = 0; i < NUMCASES; ++i) {
+		errno = 0;
+		fd = ophost_connect(cases[i].name);
+		if (check_case(i, fd, errno, "connect"))
+			err = -1;
+	}
+	return err;
+}
+
+/* everything is queued before the first reply is read */
+static int test_session()
+{
+	struct ophost_session *sess;
+	unsigned int round, i;
+	int err = 0;
+	int fd;
+
+	sess = ophost_session_open();
+	if (sess == NULL) {
+		printf("[peer] session_open failed\n");
+		return -1;
+	}
+	for (round = 0; round < SESSROUNDS; ++round) {
+		for (i = 0; i < NUMCASES; ++i) {
+			if (ophost_session_send(sess, cases[i].name)) {
+				printf("[peer] session_send failed\n");
+				err = -1;
+				goto out;
+			}
+		}
+	}
+	for (round = 0; round < SESSROUNDS; ++round) {
+		for (i = 0; i < NUMCASES; ++i) {
+			errno = 0;
+			fd = ophost_session_recv(sess);
+			if (check_case(i, fd, errno, "session"))
+				err = -1;
+		}
+	}
+out:
+	ophost_session_close(sess);
+	return err;
+}
+
+static int test_many()
+{
+	char *names[NUMCASES];
+	int fds[NUMCASES];
+	int status[NUMCASES];
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < NUMCASES; ++i)
+		names[i] = cases[i].name;
+	ophost_connect_many(names, fds, status, NUMCASES);
+	for (i = 0; i < NUMCASES; ++i) {
+		if (check_case(i, fds[i], status[i], "many"))
+			err = -1;
+	}
+	return err;
+}
+
+/*
+ * count connections each of count hosts labeled prefix<num> answered,
+ * requests are queued on a session so several are waiting at once.
+ * if each is set they all have to get some.
+ */
+static int test_spread(char *name, char *prefix, unsigned int count,
+		       int each)
+{
+	struct ophost_session *sess;
+	unsigned int served[NUMREPLICAS + NUMWORKERS];
+	char label[LABELSIZE];
+	unsigned int total = 0;
+	unsigned int num;
+	unsigned int i;
+	int err = 0;
+	int fd;
+
+	memset(served, 0, sizeof(served));
+	sess = ophost_session_open();
+	if (sess == NULL) {
+		printf("[peer] session_open failed\n");
+		return -1;
+	}
+	for (i = 0; i < SPREADCOUNT; ++i) {
+		if (ophost_session_send(sess, name)) {
+			printf("[peer] session_send failed\n");
+			err = -1;
+			goto out;
+		}
+	}
+	for (i = 0; i < SPREADCOUNT; ++i) {
+		fd = ophost_session_recv(sess);
+		if (fd == -1) {
+			printf("[peer] %s failed: %s\n", name, strerror(errno));
+			err = -1;
+			continue;
+		}
+		if (check_label(fd, prefix, label) == 0) {
+			num = strtoul(label + strlen(prefix), NULL, 10);
+			if (num < count) {
+				++served[num];
+				++total;
+			}
+		}
+		close(fd);
+	}
+	for (i = 0; i < count; ++i) {
+		printf("[peer] %s%u served %u\n", prefix, i, served[i]);
+		if (each && served[i] == 0)
+			err = -1;
+	}
+	if (total != SPREADCOUNT)
+		err = -1;
+out:
+	ophost_session_close(sess);
+	return err;
+}
+
+static void peer_exec()
+{
+	int err = 0;
+
+	printf("[peer] connect one at a time\n");
+	if (test_connect())
+		err = -1;
+	printf("[peer] connect through a session\n");
+	if (test_session())
+		err = -1;
+	printf("[peer] connect many\n");
+	if (test_many())
+		err = -1;
+	printf("[peer] spread over replicas\n");
+	if (test_spread("hosttest_replica", "replica", NUMREPLICAS, 1))
+		err = -1;
+	printf("[peer] worker threads\n");
+	if (test_spread("hosttest_workers", "workers.", NUMWORKERS, 0))
+		err = -1;
+	if (err) {
+		printf("[peer] test failed.\n");
+		exit(-1);
+	}
+	printf("[peer] test passed.\n");
+	exit(0);
+}
+
+
+static pid_t spawn(void (*exec)(unsigned int), unsigned int num)
+{
+	pid_t pid = fork();
+	if (pid == 0)
+		exec(num);
+	return pid;
+}
+
+int main(int argc, char *argv[])
+{
+	pid_t hosts[NUMHOSTS];
+	pid_t operator = -1;
+	pid_t ring = -1;
+	pid_t peer;
+	unsigned int i;
+	int retval = 0;
+	int status;
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(hosts, 0, sizeof(hosts));
+	if (argc > 1) {
+		operator = fork();
+		if (operator == 0) {
+			execv(argv[1], &argv[1]);
+			printf("[test] exec %s failed\n", argv[1]);
+			_exit(-1);
+		}
+		else if (operator == -1)
+			return -1;
+		usleep(300000); /* let operator bind it's sockets */
+	}
+
+	hosts[0] = spawn(echo_exec, 0);
+	hosts[1] = spawn(workers_exec, 0);
+	for (i = 0; i < NUMREPLICAS; ++i)
+		hosts[2 + i] = spawn(replica_exec, i);
+	hosts[2 + NUMREPLICAS] = spawn(busy_exec, 0);
+	ring = spawn(ring_exec, 0);
+	for (i = 0; i < NUMHOSTS; ++i) {
+		if (hosts[i] == -1) {
+			retval = -1;
+			goto out;
+		}
+	}
+	if (ring == -1) {
+		retval = -1;
+		goto out;
+	}
+
+	usleep(300000); /* hosts register and ping */
+	printf("forking peer...\n");
+	peer = fork();
+	if (peer == 0)
+		peer_exec();
+	else if (peer == -1) {
+		retval = -1;
+		goto out;
+	}
+	if (waitpid(peer, &status, 0) != peer || !WIFEXITED(status)
+			|| WEXITSTATUS(status) != 0) {
+		printf("[test] peer failed.\n");
+		retval = -1;
+	}
+
+	if (waitpid(ring, &status, 0) != ring || !WIFEXITED(status)
+			|| WEXITSTATUS(status) != 0) {
+		printf("[test] ring failed.\n");
+		retval = -1;
+	}
+	ring = -1;
+
+	/* every host should still be up */
+	for (i = 0; i < NUMHOSTS; ++i) {
+		if (waitpid(hosts[i], &status, WNOHANG) == hosts[i]) {
+			printf("[test] host %u exited early.\n", i);
+			hosts[i] = -1;
+			retval = -1;
+		}
+	}
+out:
+	if (ring > 0) {
+		kill(ring, SIGKILL);
+		waitpid(ring, NULL, 0);
+	}
+	for (i = 0; i < NUMHOSTS; ++i) {
+		if (hosts[i] > 0) {
+			kill(hosts[i], SIGKILL);
+			waitpid(hosts[i], NULL, 0);
+		}
+	}
+	if (operator > 0) {
+		kill(operator, SIGTERM);
+		waitpid(operator, NULL, 0);
+	}
+	return retval;
+}
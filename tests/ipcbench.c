@@ -36,6 +36,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <malloc.h>
+#include <poll.h>
 
 #include "../lib/ophost.h"
 #include "../lib/shmpair.h"
@@ -200,6 +201,7 @@ fail:
 int af_unix_host()
 {
 	struct ophost *host;
+	struct pollfd pfd;
 	int peer;
 	int ret = 0;
 	unsigned int size = 0;
@@ -217,6 +219,8 @@ int af_unix_host()
 	}
 
 	/* wait for peer */
+	pfd.fd	   = ophost_fd(host);
+	pfd.events = POLLIN;
 	peer = -1;
 	while (peer == -1) {
 		if (ophost_accept(host)) {
@@ -224,7 +228,8 @@ int af_unix_host()
 			return -1;
 		}
 		peer = ophost_handshake(host);
-		/*usleep(1000);*/
+		if (peer == -1)
+			poll(&pfd, 1, -1);
 	}
 
 	/* wait for message size */
@@ -388,6 +393,7 @@ int af_unix_peer(unsigned int size, struct perfdat *out)
 int shmpair_host()
 {
 	struct ophost *host;
+	struct pollfd pfd;
 	struct shmpair *peer;
 	int afpeer = -1;
 	int ret = 0;
@@ -406,6 +412,8 @@ int shmpair_host()
 	}
 
 	/* wait for peer */
+	pfd.fd	   = ophost_fd(host);
+	pfd.events = POLLIN;
 	afpeer = -1;
 	while (afpeer == -1) {
 		if (ophost_accept(host)) {
@@ -413,7 +421,8 @@ int shmpair_host()
 			return -1;
 		}
 		afpeer = ophost_handshake(host);
-		/*usleep(1000);*/
+		if (afpeer == -1)
+			poll(&pfd, 1, -1);
 	}
 
 	peer = shmpair_host_handshake(afpeer);
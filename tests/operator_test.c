@@ -12,9 +12,8 @@
 
 #include "../lib/ophost.h"
 #include "../eslib/eslib.h"
-#include "vllist.h"
 
-/* TODO write some real tests for operator! this is quick n dirty */
+/* register an echo host and have a peer connect to it through operator */
 
 void op_exec();
 void host_exec();
@@ -25,6 +24,7 @@ int main()
 	pid_t host;
 	pid_t peer;
 	int status;
+	int retval = 0;
 	int loop = 1;
 
 
@@ -45,6 +45,7 @@ int main()
 		return -1;
 
 
+	/* test fails if peer does */
 	while (loop)
 	{
 		if (waitpid(host, &status, WNOHANG) > 0) {
@@ -62,19 +63,23 @@ int main()
 
 		if (waitpid(peer, &status, WNOHANG) > 0) {
 			if (WIFEXITED(status)) {
-				if (WEXITSTATUS(status) < 0)
+				if (WEXITSTATUS(status) != 0) {
 					printf("[test] peer error.\n");
+					retval = -1;
+					kill(host, SIGKILL);
+				}
 				else
 					printf("[test] peer exited normally.\n");
 			}
 			else {
 				printf("[test] peer aborted.\n");
+				retval = -1;
 				kill(host, SIGKILL);
 			}
 		}
 		usleep(10000);
 	}
-	return 0;
+	return retval;
 }
 
 
@@ -122,13 +127,12 @@ void peer_exec()
 /*
  * host
  */
-int echo_service(struct vllist_node **peers);
+int new_peer(struct ophost *host, int caller, unsigned int tag, void *arg);
+int echo_peer(struct ophost *host, int client, unsigned int events,
+	      void *arg);
 void host_exec()
 {
 	struct ophost *host;
-	int caller;
-	struct vllist_node *peers = NULL;
-	struct vllist_node *newnode = NULL;
 
 	printf("[host] regsitering echo_service\n");
 	host = ophost_register("echo_service");
@@ -138,72 +142,50 @@ void host_exec()
 	}
 
 	printf("[host] testhost online\n");
-	/* simple fast host connection handling loop */
-	while (1)
-	{
-		/* ipchost upkeep -- accept new callers */
-		if (ophost_accept(host)) {
-			printf("[host] accept failed\n");
-			exit(-1);
-		}
+	/* sleeps until a caller or peer has something for us */
+	ophost_run(host, new_peer, NULL);
+	printf("[host] accept failed\n");
+	exit(-1);
+}
 
-		/* check completed, expired, or invalid handshakes */
-		while (1)
-		{
-			caller = ophost_handshake(host);
-			if (caller == -1 && errno == EAGAIN) {
-				break;
-			}
-			else if (caller == -1) {
-				printf("handshake error\n");
-				exit(-1);
-			}
-			newnode = vllist_allocnode();
-			if (newnode == NULL)
-				exit(-20);
-			vllist_addtail(&peers, newnode, (void *)caller);
-			printf("[host] new peer in list: %d\n", caller);
-		}
-		/* service update */
-		if (echo_service(&peers))
-			exit(-1);
-		usleep(10000); /*10ms*/
+
+int new_peer(struct ophost *host, int caller, unsigned int tag, void *arg)
+{
+	(void)tag;
+	(void)arg;
+	if (ophost_watch(host, caller, echo_peer, NULL)) {
+		printf("[host] watch failed\n");
+		return -1;
 	}
-	exit(0);
+	printf("[host] new peer: %d\n", caller);
+	return 0;
 }
 
-
 /*
- * for every peer node, echo messsages back
- * TODO finish writing test
+ * echo messages back to peer
  */
-int echo_service(struct vllist_node **peers)
+int echo_peer(struct ophost *host, int client, unsigned int events,
+	      void *arg)
 {
 	char msg[128];
-	int client;
-	struct vllist_node *iter;
 	int r;
 
-	if (peers == NULL)
+	(void)events;
+	(void)arg;
+	memset(msg, 0, sizeof(msg));
+	r = recv(client, msg, sizeof(msg)-1, MSG_DONTWAIT);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
 		return 0;
-
-	vllist_while_fwd(peers, iter)
-	{
-		memset(msg, 0, sizeof(msg));
-		client = (int)iter->v;
-		r = recv(client, msg, sizeof(msg)-1, MSG_DONTWAIT);
-		if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR)) {
-			printf("[echo_srv] client(%d) disconnect\n", client);
-			vllist_eject(peers, iter);
-		}
-		else if (r != -1) {
-			printf("[echo_srv] sending echo back %s\n", msg);
-			if (send(client, msg, r, 0) != r) {
-				printf("[echo_srv] shmbus_send error\n");
-				abort();
-			}
-		}
-		vllist_next(peers, iter);
+	if (r <= 0) {
+		printf("[echo_srv] client(%d) disconnect\n", client);
+		ophost_unwatch(host, client);
+		close(client);
+		return 0;
+	}
+	printf("[echo_srv] sending echo back %s\n", msg);
+	if (send(client, msg, r, 0) != r) {
+		printf("[echo_srv] shmbus_send error\n");
+		abort();
 	}
 	return 0;
 }
@@ -0,0 +1,136 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ *
+ * churn host sized records through a slab and nametable,
+ * checking that everything stays indexed and the pool stops growing
+ * once it has reached the working set size.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../slab.h"
+#include "../nametable.h"
+#include "../lib/ophost.h"
+
+#define NUMHOSTS 100000
+#define ROUNDS   8
+
+struct testhost
+{
+	int evtype;
+	char name[OPHOST_MAXNAME];
+	struct testhost *next;
+	struct testhost *prev;
+	int socket;
+	int relay;
+};
+
+static struct testhost *hosts[NUMHOSTS];
+
+static int add_host(struct slab *pool, struct nametable *names, unsigned int i)
+{
+	struct testhost *host = slab_alloc(pool);
+	if (host == NULL) {
+		printf("slab_alloc failed at %d\n", i);
+		return -1;
+	}
+	snprintf(host->name, sizeof(host->name), "host.%u", i);
+	host->socket = i;
+	if (nametable_insert(names, host->name, host)) {
+		printf("nametable_insert failed at %d\n", i);
+		return -1;
+	}
+	hosts[i] = host;
+	return 0;
+}
+
+static int del_host(struct slab *pool, struct nametable *names, unsigned int i)
+{
+	if (nametable_remove(names, hosts[i]->name) != hosts[i]) {
+		printf("nametable_remove mismatch at %d\n", i);
+		return -1;
+	}
+	slab_free(pool, hosts[i]);
+	hosts[i] = NULL;
+	return 0;
+}
+
+static int check_hosts(struct nametable *names)
+{
+	struct testhost *host;
+	char name[OPHOST_MAXNAME];
+	unsigned int i;
+
+	for (i = 0; i < NUMHOSTS; ++i) {
+		snprintf(name, sizeof(name), "host.%u", i);
+		host = nametable_lookup(names, name);
+		if (host != hosts[i]) {
+			printf("lookup mismatch at %d\n", i);
+			return -1;
+		}
+		if (host && host->socket != (int)i) {
+			printf("record corrupted at %d\n", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main()
+{
+	struct slab pool;
+	struct nametable names;
+	unsigned int i, r;
+	unsigned int total;
+
+	srand(1);
+	if (slab_init(&pool, sizeof(struct testhost), 256, 0)
+			|| nametable_init(&names, 256)) {
+		printf("init failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < NUMHOSTS; ++i) {
+		if (add_host(&pool, &names, i))
+			return -1;
+	}
+	if (check_hosts(&names))
+		return -1;
+	total = pool.total;
+
+	/* remove and re-register a random half, memory comes from free list */
+	for (r = 0; r < ROUNDS; ++r) {
+		for (i = 0; i < NUMHOSTS; ++i) {
+			if (rand() & 1 && del_host(&pool, &names, i))
+				return -1;
+		}
+		if (check_hosts(&names))
+			return -1;
+		for (i = 0; i < NUMHOSTS; ++i) {
+			if (hosts[i] == NULL && add_host(&pool, &names, i))
+				return -1;
+		}
+		if (check_hosts(&names))
+			return -1;
+	}
+	if (pool.total != total || pool.used != NUMHOSTS) {
+		printf("pool grew after warmup: %d/%d\n", pool.total, total);
+		return -1;
+	}
+
+	for (i = 0; i < NUMHOSTS; ++i) {
+		if (del_host(&pool, &names, i))
+			return -1;
+	}
+	if (pool.used != 0 || names.count != 0) {
+		printf("leaked %d records\n", pool.used);
+		return -1;
+	}
+
+	nametable_free(&names);
+	slab_destroy(&pool);
+	printf("pool test passed, %d hosts\n", NUMHOSTS);
+	return 0;
+}
@@ -0,0 +1,244 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+
+#include "timewheel.h"
+
+#define TW_MASK (TIMEWHEEL_SLOTS - 1)
+#define TW_SHIFT(level_) ((level_) * TIMEWHEEL_BITS)
+#define TW_SPAN(level_)	 (1UL << TW_SHIFT((level_) + 1))
+#define TW_MAXSPAN	 TW_SPAN(TIMEWHEEL_LEVELS - 1)
+
+/* slots and the expired list are circular, heads point to themselves */
+static void list_init(struct timer *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static void list_append(struct timer *head, struct timer *t)
+{
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+/* move everything in from to the back of to */
+static void list_splice(struct timer *from, struct timer *to)
+{
+	if (from->next == from)
+		return;
+	from->next->prev = to->prev;
+	from->prev->next = to;
+	to->prev->next = from->next;
+	to->prev = from->prev;
+	list_init(from);
+}
+
+
+void timewheel_init(struct timewheel *self, unsigned long now)
+{
+	unsigned int l, s;
+
+	memset(self, 0, sizeof(*self));
+	self->now = now;
+	for (l = 0; l < TIMEWHEEL_LEVELS; ++l) {
+		for (s = 0; s < TIMEWHEEL_SLOTS; ++s)
+			list_init(&self->slots[l][s]);
+	}
+	list_init(&self->expired);
+}
+
+
+/* place timer on lowest level that reaches it's deadline */
+static void timewheel_place(struct timewheel *self, struct timer *t)
+{
+	unsigned long delta = t->expires - self->now;
+	unsigned long when  = t->expires;
+	unsigned int level;
+	unsigned int slot;
+
+	if ((long)delta < 0) {
+		/* ticks before now were processed, it can't wait for a slot */
+		list_append(&self->expired, t);
+		return;
+	}
+	if (delta >= TW_MAXSPAN) {
+		/* parks in top level, cascades back up until it's in reach */
+		when  = self->now + TW_MAXSPAN - 1;
+		delta = TW_MAXSPAN - 1;
+	}
+	for (level = 0; delta >= TW_SPAN(level); ++level)
+		;
+	slot = (when >> TW_SHIFT(level)) & TW_MASK;
+	list_append(&self->slots[level][slot], t);
+	self->map[level] |= 1U << slot;
+}
+
+
+void timewheel_add(struct timewheel *self, struct timer *t,
+		   unsigned long expires, void *ptr)
+{
+	t->expires = expires;
+	t->ptr	   = ptr;
+	timewheel_place(self, t);
+}
+
+
+void timewheel_cancel(struct timer *t)
+{
+	if (t->next == NULL)
+		return;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = NULL;
+	t->prev = NULL;
+}
+
+
+/* re-place everything in a higher level slot, returns slot index */
+static unsigned int timewheel_cascade(struct timewheel *self,
+				      unsigned int level)
+{
+	struct timer list;
+	struct timer *t;
+	unsigned int slot = (self->now >> TW_SHIFT(level)) & TW_MASK;
+
+	list_init(&list);
+	list_splice(&self->slots[level][slot], &list);
+	self->map[level] &= ~(1U << slot);
+	while (list.next != &list)
+	{
+		t = list.next;
+		timewheel_cancel(t);
+		timewheel_place(self, t);
+	}
+	return slot;
+}
+
+
+/*
+ * ticks from self->now until the next set bit in level at or after idx,
+ * -1 if level is empty. clears stale bits it finds along the way.
+ */
+static int timewheel_scan(struct timewheel *self, unsigned int level,
+			  unsigned int idx)
+{
+	struct timer *head;
+	unsigned int map;
+	unsigned int k;
+	unsigned int slot;
+
+	while (self->map[level])
+	{
+		/* rotate so idx is bit 0 */
+		map = self->map[level];
+		if (idx)
+			map = (map >> idx) | (map << (TIMEWHEEL_SLOTS - idx));
+		k = __builtin_ctz(map);
+		slot = (idx + k) & TW_MASK;
+		head = &self->slots[level][slot];
+		if (head->next != head)
+			return k;
+		self->map[level] &= ~(1U << slot);
+	}
+	return -1;
+}
+
+
+/*
+ * ticks from self->now until the next one with work to do, a level 0
+ * expiry or a higher level cascade. -1 if the wheel is empty.
+ */
+static long timewheel_next(struct timewheel *self)
+{
+	unsigned long tick;
+	unsigned long cur;
+	unsigned long best = 0;
+	unsigned int level;
+	int found = 0;
+	int k;
+
+	for (level = 0; level < TIMEWHEEL_LEVELS; ++level) {
+		cur = self->now >> TW_SHIFT(level);
+		if (level && (self->now & ((1UL << TW_SHIFT(level)) - 1))) {
+			/* past this slot's boundary, it was already cascaded.
+			 * anything in it now is for the next turn */
+			k = timewheel_scan(self, level, (cur + 1) & TW_MASK);
+			if (k != -1)
+				++k;
+		}
+		else {
+			k = timewheel_scan(self, level, cur & TW_MASK);
+		}
+		if (k == -1)
+			continue;
+		tick = level ? (cur + k) << TW_SHIFT(level) : self->now + k;
+		if (!found || tick - self->now < best) {
+			best  = tick - self->now;
+			found = 1;
+		}
+	}
+	return found ? (long)best : -1;
+}
+
+
+void timewheel_advance(struct timewheel *self, unsigned long now)
+{
+	unsigned int level;
+	unsigned int idx;
+	long next;
+
+	while ((long)(now - self->now) >= 0)
+	{
+		idx = self->now & TW_MASK;
+		if (idx == 0) {
+			for (level = 1; level < TIMEWHEEL_LEVELS; ++level) {
+				if (timewheel_cascade(self, level))
+					break;
+			}
+		}
+		list_splice(&self->slots[0][idx], &self->expired);
+		self->map[0] &= ~(1U << idx);
+		++self->now;
+
+		/* skip straight to the next tick that has work */
+		next = timewheel_next(self);
+		if (next == -1 || (long)(self->now + next - now) > 0) {
+			self->now = now + 1;
+			break;
+		}
+		self->now += next;
+	}
+}
+
+
+struct timer *timewheel_expired(struct timewheel *self)
+{
+	struct timer *t = self->expired.next;
+	if (t == &self->expired)
+		return NULL;
+	timewheel_cancel(t);
+	return t;
+}
+
+
+long timewheel_timeout(struct timewheel *self, unsigned long now)
+{
+	unsigned long tick;
+	long next;
+
+	if (self->expired.next != &self->expired)
+		return 0;
+	next = timewheel_next(self);
+	if (next == -1)
+		return -1;
+	tick = self->now + next;
+	if ((long)(tick - now) <= 0)
+		return 0;
+	return tick - now;
+}
@@ -0,0 +1,67 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ *
+ * timewheel
+ *
+ * hierarchical timing wheel with 1ms ticks. TIMEWHEEL_LEVELS wheels of
+ * TIMEWHEEL_SLOTS slots each, a timer is placed on the lowest level that
+ * covers it's deadline and cascades down as the wheel turns. add and cancel
+ * are O(1), advancing costs the timers that expire plus at most one cascade
+ * per level for each slot boundary crossed. empty stretches are skipped.
+ *
+ * time is any millisecond clock that only moves forward, wraparound is ok.
+ * not thread safe, each thread should own it's wheels.
+ */
+
+#ifndef TIMEWHEEL_H__
+#define TIMEWHEEL_H__
+
+#define TIMEWHEEL_BITS	 5
+#define TIMEWHEEL_SLOTS	 (1 << TIMEWHEEL_BITS)
+#define TIMEWHEEL_LEVELS 6 /* 2^30 ms, about 12 days */
+
+struct timer
+{
+	struct timer *next; /* NULL if not pending */
+	struct timer *prev;
+	unsigned long expires;
+	void *ptr;	    /* handed back on expiry */
+};
+
+struct timewheel
+{
+	unsigned long now; /* next tick to be processed */
+	unsigned int map[TIMEWHEEL_LEVELS]; /* may have stale bits set */
+	struct timer slots[TIMEWHEEL_LEVELS][TIMEWHEEL_SLOTS];
+	struct timer expired;
+};
+
+void timewheel_init(struct timewheel *self, unsigned long now);
+
+/* timer must not be pending, a deadline that passed is expired right away,
+ * timewheel_expired returns it without waiting for an advance */
+void timewheel_add(struct timewheel *self, struct timer *t,
+		   unsigned long expires, void *ptr);
+
+/* safe to call on a timer that is not pending */
+void timewheel_cancel(struct timer *t);
+#define timewheel_pending(t_) ((t_)->next != NULL)
+
+/* move everything due at or before now to the expired list */
+void timewheel_advance(struct timewheel *self, unsigned long now);
+
+/*
+ * returns
+ * next expired timer, no longer pending
+ * NULL if there are none
+ */
+struct timer *timewheel_expired(struct timewheel *self);
+
+/*
+ * returns
+ * milliseconds from now until the wheel needs to advance
+ * -1 if there are no timers
+ */
+long timewheel_timeout(struct timewheel *self, unsigned long now);
+
+#endif
@@ -0,0 +1,148 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <malloc.h>
+
+#include "uidtable.h"
+
+#define uidtable_full(self_, count_) ((count_) * 4 >= (self_)->size * 3)
+#define uidtable_home(self_, uid_) \
+	(((unsigned int)(uid_) * 2654435761u) & ((self_)->size - 1))
+
+
+int uidtable_init(struct uidtable *self, unsigned int size)
+{
+	unsigned int n = 16;
+
+	while (n < size)
+		n <<= 1;
+	self->slots = malloc(n * sizeof(struct uidcount));
+	if (self->slots == NULL)
+		return -1;
+	memset(self->slots, 0, n * sizeof(struct uidcount));
+	self->size  = n;
+	self->count = 0;
+	return 0;
+}
+
+
+void uidtable_free(struct uidtable *self)
+{
+	free(self->slots);
+	self->slots = NULL;
+	self->size  = 0;
+	self->count = 0;
+}
+
+
+/* returns slot of uid, or empty slot where it belongs */
+static unsigned int uidtable_find(struct uidtable *self, uid_t uid)
+{
+	unsigned int mask = self->size - 1;
+	unsigned int i = uidtable_home(self, uid);
+	while (self->slots[i].used && self->slots[i].uid != uid)
+		i = (i + 1) & mask;
+	return i;
+}
+
+
+static int uidtable_grow(struct uidtable *self)
+{
+	struct uidcount *old = self->slots;
+	unsigned int oldsize = self->size;
+	unsigned int i, n;
+
+	self->slots = malloc(oldsize * 2 * sizeof(struct uidcount));
+	if (self->slots == NULL) {
+		self->slots = old;
+		return -1;
+	}
+	memset(self->slots, 0, oldsize * 2 * sizeof(struct uidcount));
+	self->size = oldsize * 2;
+
+	for (i = 0; i < oldsize; ++i) {
+		if (!old[i].used)
+			continue;
+		n = uidtable_find(self, old[i].uid);
+		memcpy(&self->slots[n], &old[i], sizeof(struct uidcount));
+	}
+	free(old);
+	return 0;
+}
+
+
+/* backward shift delete slot i */
+static void uidtable_remove(struct uidtable *self, unsigned int i)
+{
+	unsigned int mask = self->size - 1;
+	unsigned int n = i;
+	unsigned int home;
+
+	while (1)
+	{
+		n = (n + 1) & mask;
+		if (!self->slots[n].used)
+			break;
+		home = uidtable_home(self, self->slots[n].uid);
+		if (i <= n) {
+			if (i < home && home <= n)
+				continue;
+		}
+		else if (i < home || home <= n) {
+			continue;
+		}
+		memcpy(&self->slots[i], &self->slots[n],
+				sizeof(struct uidcount));
+		i = n;
+	}
+	memset(&self->slots[i], 0, sizeof(struct uidcount));
+	--self->count;
+}
+
+
+unsigned int uidtable_count(struct uidtable *self, uid_t uid, int type)
+{
+	unsigned int i = uidtable_find(self, uid);
+	if (!self->slots[i].used)
+		return 0;
+	return self->slots[i].count[type];
+}
+
+
+int uidtable_inc(struct uidtable *self, uid_t uid, int type)
+{
+	unsigned int i = uidtable_find(self, uid);
+
+	if (!self->slots[i].used) {
+		if (uidtable_full(self, self->count + 1)) {
+			if (uidtable_grow(self))
+				return -1;
+			i = uidtable_find(self, uid);
+		}
+		memset(&self->slots[i], 0, sizeof(struct uidcount));
+		self->slots[i].uid  = uid;
+		self->slots[i].used = 1;
+		++self->count;
+	}
+	++self->slots[i].count[type];
+	return 0;
+}
+
+
+void uidtable_dec(struct uidtable *self, uid_t uid, int type)
+{
+	unsigned int i = uidtable_find(self, uid);
+	unsigned int t;
+
+	if (!self->slots[i].used || self->slots[i].count[type] == 0)
+		return;
+	--self->slots[i].count[type];
+	for (t = 0; t < UIDCOUNT_TYPES; ++t) {
+		if (self->slots[i].count[t])
+			return;
+	}
+	uidtable_remove(self, i);
+}
@@ -0,0 +1,58 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ *
+ * uidtable
+ *
+ * per-uid resource counters, so limits can be checked without walking
+ * every handshake and host. open addressing keyed by uid, an entry is
+ * removed when all of it's counters drop back to 0.
+ */
+
+#ifndef UIDTABLE_H__
+#define UIDTABLE_H__
+
+#include <sys/types.h>
+
+/* what is being counted */
+enum {
+	UIDCOUNT_REGISTR = 0, /* pending registrations */
+	UIDCOUNT_REQUEST,     /* pending connection requests */
+	UIDCOUNT_HOSTS,	      /* registered hosts */
+	UIDCOUNT_SESSION,     /* open caller sessions */
+	UIDCOUNT_TYPES
+};
+
+struct uidcount
+{
+	uid_t uid;
+	unsigned int used;
+	unsigned int count[UIDCOUNT_TYPES];
+};
+
+struct uidtable
+{
+	struct uidcount *slots;
+	unsigned int size;  /* always a power of 2 */
+	unsigned int count;
+};
+
+/*
+ * returns
+ *  0 if ok
+ * -1 on error
+ */
+int uidtable_init(struct uidtable *self, unsigned int size);
+void uidtable_free(struct uidtable *self);
+
+/* returns current count for uid */
+unsigned int uidtable_count(struct uidtable *self, uid_t uid, int type);
+
+/*
+ * returns
+ *  0 if ok
+ * -1 on error (out of memory)
+ */
+int uidtable_inc(struct uidtable *self, uid_t uid, int type);
+void uidtable_dec(struct uidtable *self, uid_t uid, int type);
+
+#endif
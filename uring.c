@@ -0,0 +1,230 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define uring_load(p_)	   __atomic_load_n((p_), __ATOMIC_ACQUIRE)
+#define uring_store(p_, v_) __atomic_store_n((p_), (v_), __ATOMIC_RELEASE)
+
+
+static int uring_enter(int fd, unsigned int to_submit,
+		       unsigned int wait_nr, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags,
+		       NULL, 0);
+}
+
+/*
+ * multishot accept arrived in 5.19 along with IORING_OP_SOCKET,
+ * it has no probe bit of it's own.
+ */
+static int uring_probe(int fd)
+{
+	struct io_uring_probe *probe;
+	size_t size;
+	int ok = 0;
+
+	size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = malloc(size);
+	if (probe == NULL)
+		return 0;
+	memset(probe, 0, size);
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+				probe, 256) == 0
+			&& probe->last_op >= IORING_OP_SOCKET
+			&& probe->ops[IORING_OP_SOCKET].flags
+			   & IO_URING_OP_SUPPORTED)
+		ok = 1;
+	free(probe);
+	return ok;
+}
+
+
+int uring_init(struct uring *self, unsigned int entries)
+{
+	struct io_uring_params p;
+	unsigned int i;
+	size_t sqes_len;
+	char *ring;
+
+	memset(self, 0, sizeof(*self));
+	memset(&p, 0, sizeof(p));
+	self->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (self->fd == -1)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+			|| !uring_probe(self->fd)) {
+		close(self->fd);
+		self->fd = -1;
+		errno = ENOSYS;
+		return -1;
+	}
+
+	/* sq and cq rings share one mapping */
+	self->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	self->cq_len = p.cq_off.cqes
+		     + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (self->cq_len > self->sq_len)
+		self->sq_len = self->cq_len;
+	self->sq_ring = mmap(NULL, self->sq_len, PROT_READ|PROT_WRITE,
+			     MAP_SHARED|MAP_POPULATE, self->fd,
+			     IORING_OFF_SQ_RING);
+	if (self->sq_ring == MAP_FAILED)
+		goto fail;
+	self->cq_ring = self->sq_ring;
+
+	sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	self->sqes = mmap(NULL, sqes_len, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, self->fd, IORING_OFF_SQES);
+	if (self->sqes == MAP_FAILED) {
+		munmap(self->sq_ring, self->sq_len);
+		goto fail;
+	}
+
+	ring = self->sq_ring;
+	self->sq_head  = (unsigned int *)(ring + p.sq_off.head);
+	self->sq_tail  = (unsigned int *)(ring + p.sq_off.tail);
+	self->sq_mask  = (unsigned int *)(ring + p.sq_off.ring_mask);
+	self->sq_array = (unsigned int *)(ring + p.sq_off.array);
+	self->sq_flags = (unsigned int *)(ring + p.sq_off.flags);
+	self->cq_head  = (unsigned int *)(ring + p.cq_off.head);
+	self->cq_tail  = (unsigned int *)(ring + p.cq_off.tail);
+	self->cq_mask  = (unsigned int *)(ring + p.cq_off.ring_mask);
+	self->cqes     = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	self->sq_entries = p.sq_entries;
+
+	/* sqes are always used in ring order */
+	for (i = 0; i < p.sq_entries; ++i)
+		self->sq_array[i] = i;
+	return 0;
+
+fail:
+	close(self->fd);
+	self->fd = -1;
+	return -1;
+}
+
+
+void uring_destroy(struct uring *self)
+{
+	if (self->fd == -1)
+		return;
+	munmap(self->sqes, self->sq_entries * sizeof(struct io_uring_sqe));
+	munmap(self->sq_ring, self->sq_len);
+	close(self->fd);
+	memset(self, 0, sizeof(*self));
+	self->fd = -1;
+}
+
+
+struct io_uring_sqe *uring_sqe(struct uring *self)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *self->sq_tail;
+
+	if (tail - uring_load(self->sq_head) >= self->sq_entries) {
+		if (uring_submit(self, 0) == -1)
+			return NULL;
+		if (tail - uring_load(self->sq_head) >= self->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+
+	/* kernel only looks at the tail during io_uring_enter */
+	sqe = &self->sqes[tail & *self->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	uring_store(self->sq_tail, tail + 1);
+	++self->queued;
+	return sqe;
+}
+
+
+int uring_submit(struct uring *self, unsigned int wait_nr)
+{
+	unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	int retval;
+
+	while (1)
+	{
+		retval = uring_enter(self->fd, self->queued, wait_nr, flags);
+		if (retval == -1 && errno == EINTR)
+			continue;
+		break;
+	}
+	if (retval > 0)
+		self->queued -= retval;
+	return retval;
+}
+
+
+void uring_flush(struct uring *self)
+{
+	if (uring_load(self->sq_flags) & IORING_SQ_CQ_OVERFLOW)
+		uring_enter(self->fd, 0, 0, IORING_ENTER_GETEVENTS);
+}
+
+
+struct io_uring_cqe *uring_peek(struct uring *self)
+{
+	unsigned int head = *self->cq_head;
+
+	if (head == uring_load(self->cq_tail))
+		return NULL;
+	return &self->cqes[head & *self->cq_mask];
+}
+
+
+void uring_seen(struct uring *self)
+{
+	uring_store(self->cq_head, *self->cq_head + 1);
+}
+
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+				 int flags, void *user_data)
+{
+	sqe->opcode	  = IORING_OP_ACCEPT;
+	sqe->fd		  = fd;
+	sqe->ioprio	  = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = flags;
+	sqe->user_data	  = (unsigned long)user_data;
+}
+
+void uring_prep_recvmsg(struct io_uring_sqe *sqe, int fd,
+			struct msghdr *msg, int flags, void *user_data)
+{
+	sqe->opcode    = IORING_OP_RECVMSG;
+	sqe->fd	       = fd;
+	sqe->addr      = (unsigned long)msg;
+	sqe->len       = 1;
+	sqe->msg_flags = flags;
+	sqe->user_data = (unsigned long)user_data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+			struct msghdr *msg, int flags, void *user_data)
+{
+	sqe->opcode    = IORING_OP_SENDMSG;
+	sqe->fd	       = fd;
+	sqe->addr      = (unsigned long)msg;
+	sqe->len       = 1;
+	sqe->msg_flags = flags;
+	sqe->user_data = (unsigned long)user_data;
+}
+
+void uring_prep_close(struct io_uring_sqe *sqe, int fd, void *user_data)
+{
+	sqe->opcode    = IORING_OP_CLOSE;
+	sqe->fd	       = fd;
+	sqe->user_data = (unsigned long)user_data;
+}
@@ -0,0 +1,92 @@
+/* (c) 2015 Michael R. Tirado -- GPLv3, GNU General Public License, version 3.
+ * contact: mtirado418@gmail.com
+ *
+ * uring
+ *
+ * bare io_uring submission/completion rings over the raw syscalls, just
+ * enough for multishot accept and batched sendmsg/recvmsg. user_data is
+ * whatever the caller wants back in the completion.
+ *
+ * rings are not thread safe, each thread should have it's own.
+ */
+
+#ifndef URING_H__
+#define URING_H__
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+struct uring
+{
+	int fd; /* -1 if not initialized */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *sq_flags;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_entries;
+	unsigned int queued; /* sqes not yet submitted */
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_len;
+	size_t cq_len;
+};
+
+/*
+ * fails if the kernel can't do multishot accept (older than 5.19),
+ * or io_uring is disabled.
+ * returns
+ *  0 if ok
+ * -1 on error
+ */
+int uring_init(struct uring *self, unsigned int entries);
+void uring_destroy(struct uring *self);
+
+/*
+ * next free sqe, zeroed. queued sqes are submitted first if ring is full.
+ * returns
+ * sqe
+ * NULL on error
+ */
+struct io_uring_sqe *uring_sqe(struct uring *self);
+
+/*
+ * submit queued sqes and wait for wait_nr completions.
+ * returns
+ * number of sqes submitted
+ * -1 on error
+ */
+int uring_submit(struct uring *self, unsigned int wait_nr);
+
+/*
+ * when the cq is full the kernel holds completions back, and the ring fd
+ * doesn't poll readable for them. this moves them into the cq.
+ */
+void uring_flush(struct uring *self);
+
+/*
+ * returns
+ * oldest completion, stays valid until uring_seen
+ * NULL if there are none
+ */
+struct io_uring_cqe *uring_peek(struct uring *self);
+void uring_seen(struct uring *self);
+
+/* accepted sockets are created with flags (SOCK_NONBLOCK, SOCK_CLOEXEC) */
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+				 int flags, void *user_data);
+void uring_prep_recvmsg(struct io_uring_sqe *sqe, int fd,
+			struct msghdr *msg, int flags, void *user_data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+			struct msghdr *msg, int flags, void *user_data);
+void uring_prep_close(struct io_uring_sqe *sqe, int fd, void *user_data);
+
+#define uring_user_data(cqe_) ((void *)(unsigned long)(cqe_)->user_data)
+
+#endif